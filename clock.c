@@ -0,0 +1,57 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+#include <pthread.h>
+#include <string.h>
+#include <syslog.h>
+
+#include "clock.h"
+
+atomic_llong clock_secs = -1;
+
+static void *
+clock_loop(void *context)
+{
+  struct timespec ts = { 0, CLOCK_TICK_MS * 1000000 };
+
+  while (1)
+    {
+      atomic_store_explicit(&clock_secs, clock_read(), memory_order_relaxed);
+      nanosleep(&ts, NULL);
+    }
+  return NULL;
+}
+
+bool
+clock_start(void)
+{
+  pthread_t thread;
+  int rc;
+
+  atomic_store_explicit(&clock_secs, clock_read(), memory_order_relaxed);
+  rc = pthread_create(&thread, NULL, clock_loop, NULL);
+  if (rc)
+    {
+      syslog(LOG_ERR, "cannot start the clock thread: %s", strerror(rc));
+      atomic_store_explicit(&clock_secs, -1, memory_order_relaxed);
+      return false;
+    }
+  pthread_detach(thread);
+  return true;
+}
@@ -0,0 +1,57 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+#ifndef EDAMAME_CLOCK_H_
+#define EDAMAME_CLOCK_H_ 1
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <time.h>
+
+// Item expiration counts in seconds of CLOCK_MONOTONIC_COARSE. Once
+// clock_start runs, a timer thread stores them every CLOCK_TICK_MS and
+// clock_now only loads the copy, otherwise it reads the clock.
+#define CLOCK_TICK_MS 100
+
+// -1 while nothing keeps it up to date
+extern atomic_llong clock_secs;
+
+static inline time_t
+clock_read(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+  return ts.tv_sec;
+}
+
+static inline time_t
+clock_now(void)
+{
+  long long secs;
+
+  secs = atomic_load_explicit(&clock_secs, memory_order_relaxed);
+  if (__builtin_expect(secs < 0, 0))
+    return clock_read();
+  return secs;
+}
+
+bool clock_start(void);
+
+#endif
@@ -24,7 +24,7 @@
 #include <ctype.h>
 #include <inttypes.h> // PRIu64
 #include <syslog.h>
-#include <urcu.h>
+#include <urcu-qsbr.h>
 
 char EOL[] = "\r\n";
 char ascii_ok[] = "ASCII OK\r\n";
@@ -188,7 +188,7 @@ process_cmd_get(void *lru_, cmd_handler *cmd, ed_writer *writer)
 {
   lru_t *lru = lru_;
   lru_val_t lru_val;
-  size_t header_len, vallen;
+  size_t header_len, vallen, mark;
 retry:
   rcu_read_lock();
   if (lru_get(lru, cmd, &lru_val))
@@ -213,6 +213,7 @@ retry:
           rcu_read_unlock();
           goto retry;
         }
+      mark = writer_mark(writer);
       writer_append(writer, "VALUE ", sizeof("VALUE ") - 1);
       writer_append(writer, cmd->key, cmd->req.keylen);
       if (cmd->state == ASCII_PENDING_GET_CAS_MULTI)
@@ -236,6 +237,13 @@ retry:
           writer_append(writer, lru_val.value, vallen);
           writer_append(writer, EOL, sizeof(EOL) - 1);
         }
+      if (!lru_val_valid(&lru_val))
+        {
+          // Overwritten in place while we copied it
+          writer_rewind(writer, mark);
+          rcu_read_unlock();
+          goto retry;
+        }
       rcu_read_unlock();
     }
   else
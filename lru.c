@@ -19,14 +19,23 @@
 
 #include "lru.h"
 #include "cityhash.h"
+#include "clock.h"
 #include "cmd_parser.h"
+#include "slab.h"
 #include "util.h"
+#include <errno.h>
+#include <linux/mempolicy.h>
+#include <pthread.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
 #include <syslog.h>
 #include <time.h>
-#include <urcu.h>
+#include <unistd.h>
+#include <urcu-qsbr.h>
 
 struct inner_bucket
 {
@@ -40,17 +49,55 @@ struct inner_bucket
   uint8_t data[0];
 } __attribute__((packed));
 
+// magic of a bucket:
+// 0x00 empty
+// 0x01 occupied
+// 0x02 deleted, can be reused by an insert
+// 0x42 deleted, cannot be reused until the readers have drained
+// 0x80, 0x82 locked by a writer inserting or deleting, readers treat
+//   them as empty or deleted
+// 0x81 locked by a writer, still readable as occupied
+// 0x03 updated, readers look at the tmp bucket tmp_idx
+// 0x83 updated and locked by a writer, readable like 0x03
+// 0x06 moved to the new table by a resize, or sealed if it was free
+//
+// A writer holding 0x81 may also overwrite a small value in place. It
+// makes seq odd for the duration of the write, readers retry when seq
+// changed under them.
 struct bucket
 {
   atomic_uchar magic;
+  uint8_t pad;
+  atomic_ushort tmp_idx;
+  atomic_uint seq;
   volatile uint64_t txid;
   struct inner_bucket ibucket;
-} __attribute__((packed));
+};
+
+// Reclamation deferred to after a grace period with call_rcu. For an
+// update it commits the tmp bucket back into the bucket, unless a later
+// update replaced it, and releases the tmp bucket after another grace
+// period. For a delete it frees the out of line key and value and turns
+// the bucket into a reusable tombstone.
+struct lru_deferred
+{
+  struct rcu_head head;
+  lru_t *lru;
+  struct bucket *bucket;
+  void *keyptr;
+  void *valptr;
+  // the sizes tell where the key and value go back to
+  size_t keylen;
+  size_t vallen;
+  uint16_t tmp_idx;
+};
 
-void lru_write_empty_bucket(lru_t *lru, struct bucket *bucket,
+bool lru_write_empty_bucket(lru_t *lru, struct bucket *bucket,
                             cmd_handler *cmd, lru_val_t *lru_val);
-bool lru_update_bucket(lru_t *lru, struct bucket *bucket, cmd_handler *cmd,
-                       lru_val_t *lru_val);
+bool lru_update_bucket(lru_t *lru, struct bucket *bucket,
+                       struct inner_bucket *ibucket, cmd_handler *cmd,
+                       lru_val_t *lru_val, void **garbage,
+                       size_t *garbage_len);
 
 uint64_t
 lru_capacity_(uint8_t capacity_clz, uint8_t capacity_ms4b)
@@ -58,315 +105,1546 @@ lru_capacity_(uint8_t capacity_clz, uint8_t capacity_ms4b)
   return (1ULL << (64 - capacity_clz - 4)) * capacity_ms4b;
 }
 
+static inline uint64_t
+lru_table_capacity(lru_table *table)
+{
+  return lru_capacity_(table->capacity_clz, table->capacity_ms4b);
+}
+
 uint64_t
 lru_capacity(lru_t *lru)
 {
-  return lru_capacity_(lru->capacity_clz, lru->capacity_ms4b);
+  return lru_table_capacity(
+      atomic_load_explicit(&lru->table, memory_order_acquire));
 }
 
-lru_t *
-lru_init(uint64_t num_objects, size_t inline_keylen, size_t inline_vallen)
+// Like memcached, an expiration of 0 keeps the item until it is evicted
+static inline time_t
+lru_epoch(time_t now, uint32_t expiration)
 {
-  lru_t *lru;
+  return expiration ? now + expiration : 0;
+}
+
+// Buckets are padded to 8 bytes so that seq and txid stay aligned. The
+// inline key and value follow the packed ibucket, not the tail padding
+// of struct bucket.
+static inline size_t
+lru_bucket_size(size_t inline_keylen, size_t inline_vallen)
+{
+  return (offsetof(struct bucket, ibucket) + sizeof(struct inner_bucket)
+          + inline_keylen + inline_vallen + 7)
+         & ~7UL;
+}
+
+static atomic_ullong lru_next_table_gen = 1;
+
+bool lru_hugetlb = false;
+bool lru_interleave = false;
+
+// Nodes in the list format of /sys/devices/system/node/online, like
+// "0-1,3". Returns the number of bits of mask in use, 0 on failure.
+static unsigned long
+lru_online_nodes(unsigned long *mask, unsigned long maxnode)
+{
+  FILE *file;
+  unsigned long first, last, nbits = 0;
+  int c;
+
+  memset(mask, 0, maxnode / 8);
+  file = fopen("/sys/devices/system/node/online", "r");
+  if (!file)
+    return 0;
+  while (fscanf(file, "%lu", &first) == 1)
+    {
+      last = first;
+      c = fgetc(file);
+      if (c == '-' && fscanf(file, "%lu", &last) == 1)
+        c = fgetc(file);
+      for (; first <= last && first < maxnode; first++)
+        mask[first / (8 * sizeof(long))] |= 1UL << first % (8 * sizeof(long));
+      if (last + 1 > nbits)
+        nbits = last + 1 < maxnode ? last + 1 : maxnode;
+      if (c != ',')
+        break;
+    }
+  fclose(file);
+  return nbits;
+}
+
+// Spread the pages of a table round robin over the online nodes, so
+// that no node serves all the probes. Only pages faulted in afterwards
+// are placed.
+static void
+lru_table_interleave(lru_table *table)
+{
+  unsigned long mask[LRU_MAX_NODES / (8 * sizeof(long))], nbits;
+
+  nbits = lru_online_nodes(mask, LRU_MAX_NODES);
+  if (!nbits)
+    {
+      syslog(LOG_WARNING, "cannot read the online numa nodes");
+      return;
+    }
+  if (syscall(SYS_mbind, table->buckets, table->map_size, MPOL_INTERLEAVE,
+              mask, nbits + 1, 0))
+    syslog(LOG_WARNING, "cannot interleave a table over numa nodes: %s",
+           strerror(errno));
+}
+
+// Maps a table: the buckets, followed by the tags. Explicit huge pages
+// with lru_hugetlb, else transparent huge pages if the kernel has them.
+// The memory is zeroed like calloc.
+static bool
+lru_table_map(lru_table *table, size_t size)
+{
+  int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+  void *ptr = MAP_FAILED;
+
+  if (lru_hugetlb)
+    {
+      table->page_size = LRU_HUGE_PAGE;
+      table->map_size = round_up_div(size, LRU_HUGE_PAGE) * LRU_HUGE_PAGE;
+      ptr = mmap(NULL, table->map_size, PROT_READ | PROT_WRITE,
+                 flags | MAP_HUGETLB, -1, 0);
+      if (ptr == MAP_FAILED)
+        syslog(LOG_WARNING, "no huge pages for a table of %zu bytes: %s",
+               size, strerror(errno));
+    }
+  if (ptr == MAP_FAILED)
+    {
+      table->page_size = sysconf(_SC_PAGESIZE);
+      table->map_size
+          = round_up_div(size, table->page_size) * table->page_size;
+      ptr = mmap(NULL, table->map_size, PROT_READ | PROT_WRITE, flags, -1, 0);
+      if (ptr == MAP_FAILED)
+        {
+          syslog(LOG_ERR, "cannot map a table of %zu bytes: %s", size,
+                 strerror(errno));
+          return false;
+        }
+#ifdef MADV_HUGEPAGE
+      table->thp = table->map_size >= LRU_HUGE_PAGE
+                   && !madvise(ptr, table->map_size, MADV_HUGEPAGE);
+#endif
+    }
+  table->buckets = ptr;
+  if (lru_interleave)
+    lru_table_interleave(table);
+  return true;
+}
+
+static lru_table *
+lru_table_alloc(uint8_t capacity_clz, uint8_t capacity_ms4b,
+                size_t bucket_size)
+{
+  lru_table *table;
   uint64_t capacity;
-  uint32_t capacity_clz, capacity_ms4b, capacity_msb;
-  size_t ibucket_size, bucket_size;
 
-  lru = calloc(sizeof(lru_t), 1);
+  table = calloc(1, sizeof(lru_table));
+  table->gen = atomic_fetch_add_explicit(&lru_next_table_gen, 1,
+                                         memory_order_relaxed);
+  capacity = lru_capacity_(capacity_clz, capacity_ms4b);
+
+  table->capacity_clz = capacity_clz;
+  table->capacity_ms4b = capacity_ms4b;
+  // A probe group is read with one 4 byte load, even at the last bucket
+  if (!lru_table_map(table, capacity * bucket_size + capacity + 3))
+    {
+      free(table);
+      return NULL;
+    }
+  table->tags = table->buckets + capacity * bucket_size;
+  return table;
+}
+
+static lru_table *
+lru_table_new(uint64_t num_objects, size_t bucket_size)
+{
+  uint64_t capacity;
+  uint32_t capacity_clz, capacity_ms4b, capacity_msb;
 
   capacity = num_objects * 10 / 7;
   capacity_clz = __builtin_clzl(capacity);
   capacity_msb = 64 - capacity_clz;
   capacity_ms4b = round_up_div(capacity, 1UL << (capacity_msb - 4));
-  capacity = lru_capacity_(capacity_clz, capacity_ms4b);
+  return lru_table_alloc(capacity_clz, capacity_ms4b, bucket_size);
+}
+
+static void
+lru_table_free(lru_table *table)
+{
+  munmap(table->buckets, table->map_size);
+  free(table);
+}
+
+struct lru_prefault_part
+{
+  uint8_t *start;
+  size_t len;
+  size_t page_size;
+};
+
+static void *
+lru_prefault_part(void *context)
+{
+  struct lru_prefault_part *part = context;
+
+#ifdef MADV_POPULATE_WRITE
+  if (!madvise(part->start, part->len, MADV_POPULATE_WRITE))
+    return NULL;
+#endif
+  for (size_t off = 0; off < part->len; off += part->page_size)
+    ((volatile uint8_t *)part->start)[off] = 0;
+  return NULL;
+}
+
+// Fault in the pages of a table nobody uses yet, split over nthreads
+// threads. Writing a zero is enough since the table is still empty.
+static void
+lru_table_prefault(lru_table *table, int nthreads)
+{
+  size_t pages, first, last;
+  int started;
+
+  // No point in more threads than pages
+  pages = table->map_size / table->page_size;
+  if ((size_t)nthreads > pages)
+    nthreads = pages;
+  if (nthreads < 1)
+    return;
+  struct lru_prefault_part parts[nthreads];
+  pthread_t threads[nthreads];
+
+  for (int i = 0; i < nthreads; i++)
+    {
+      first = pages * i / nthreads;
+      last = pages * (i + 1) / nthreads;
+      parts[i].start = table->buckets + first * table->page_size;
+      parts[i].len = (last - first) * table->page_size;
+      parts[i].page_size = table->page_size;
+    }
+  // Part 0 is done by the calling thread
+  for (started = 1; started < nthreads; started++)
+    if (pthread_create(&threads[started], NULL, lru_prefault_part,
+                       &parts[started]))
+      break;
+  // So are the parts no thread could be started for
+  for (int i = started; i < nthreads; i++)
+    lru_prefault_part(&parts[i]);
+  lru_prefault_part(&parts[0]);
+  for (int i = 1; i < started; i++)
+    pthread_join(threads[i], NULL);
+}
+
+void
+lru_prefault(lru_t *lru, int nthreads)
+{
+  if (nthreads < 1)
+    nthreads = 1;
+  lru->prefault_threads = nthreads;
+  lru_table_prefault(atomic_load_explicit(&lru->table, memory_order_acquire),
+                     nthreads);
+}
+
+static inline uint64_t
+lru_table_mem(lru_table *table)
+{
+  return table->map_size;
+}
+
+// Fingerprint of a key in lru_table.tags, from hash bits the bucket
+// index does not depend on much.
+static inline uint8_t
+lru_tag(uint64_t hashed_key)
+{
+  return 0x80 | hashed_key >> 57;
+}
+
+// Set before the item is published with magic 1, readers see the tag of
+// any item they can see.
+static inline void
+lru_set_tag(lru_table *table, uint64_t idx, uint8_t tag)
+{
+  ((volatile uint8_t *)table->tags)[idx] = tag;
+}
+
+// Slots of the probe group at idx worth looking at for a key with tag:
+// the tag matches, or the bucket was never used and may end the probe.
+// One bit per slot, the first slot in bit 0.
+static inline unsigned int
+lru_tag_candidates(lru_table *table, uint64_t idx, uint64_t capacity,
+                   uint8_t tag)
+{
+  uint32_t group;
+
+  if (__builtin_expect(idx + 4 <= capacity, 1))
+    memcpy(&group, &table->tags[idx], 4);
+  else
+    {
+      uint8_t bytes[4];
+      for (int i = 0; i < 4; i++)
+        bytes[i] = table->tags[(idx + i) % capacity];
+      memcpy(&group, bytes, 4);
+    }
+#ifdef __SSE2__
+  __m128i tags = _mm_cvtsi32_si128(group);
+  __m128i hits = _mm_or_si128(_mm_cmpeq_epi8(tags, _mm_set1_epi8(tag)),
+                              _mm_cmpeq_epi8(tags, _mm_setzero_si128()));
+  return _mm_movemask_epi8(hits) & 0xf;
+#else
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  group = __builtin_bswap32(group);
+#endif
+  uint32_t hit, x;
+  // the high bit of each byte that is zero in x
+  x = group ^ (0x01010101U * tag);
+  hit = ~(((x & 0x7f7f7f7f) + 0x7f7f7f7f) | x | 0x7f7f7f7f);
+  x = group;
+  hit |= ~(((x & 0x7f7f7f7f) + 0x7f7f7f7f) | x | 0x7f7f7f7f);
+  return (hit >> 7 & 1) | (hit >> 14 & 2) | (hit >> 21 & 4) | (hit >> 28 & 8);
+#endif
+}
+
+// The current table and, while a resize is in progress, the table its
+// items are moved from. table is loaded first: lru_resize publishes
+// old_table before the new table.
+static inline void
+lru_tables(lru_t *lru, lru_table **table, lru_table **old_table)
+{
+  *table = atomic_load_explicit(&lru->table, memory_order_acquire);
+  *old_table = atomic_load_explicit(&lru->old_table, memory_order_acquire);
+  if (*old_table == *table)
+    *old_table = NULL;
+}
+
+// Value class of an out of line value of vallen bytes, LRU_VAL_CLASSES
+// for the values left to the slab.
+static inline int
+lru_val_class(size_t vallen)
+{
+  int cls = 0;
+
+  while (cls < LRU_VAL_CLASSES && LRU_VAL_CLASS_SIZE(cls) < vallen)
+    cls++;
+  return cls;
+}
+
+// Bytes an out of line value of vallen bytes takes
+static inline size_t
+lru_val_size(size_t vallen)
+{
+  int cls = lru_val_class(vallen);
+
+  return cls < LRU_VAL_CLASSES ? LRU_VAL_CLASS_SIZE(cls)
+                               : slab_chunk_size(vallen);
+}
+
+// Out of line keys and values are counted by the chunk or slot they take
+static inline void
+lru_out_add(lru_t *lru, size_t bytes)
+{
+  atomic_fetch_add_explicit(&lru->out_bytes, bytes, memory_order_relaxed);
+}
+
+static inline void
+lru_out_sub(lru_t *lru, size_t bytes)
+{
+  atomic_fetch_sub_explicit(&lru->out_bytes, bytes, memory_order_relaxed);
+}
+
+// Memory of the bucket tables plus the out of line keys and values, the
+// quantity mem_limit bounds.
+uint64_t
+lru_mem_used(lru_t *lru)
+{
+  lru_table *table, *old_table;
+  uint64_t used;
+
+  lru_tables(lru, &table, &old_table);
+  used = lru_table_mem(table);
+  if (old_table)
+    used += lru_table_mem(old_table);
+  used += atomic_load_explicit(&lru->out_bytes, memory_order_relaxed);
+  return used;
+}
+
+// First slot of a page of value slots
+struct lru_val_page
+{
+  struct lru_val_page *next;
+  struct lru_val_shard *shard;
+};
+
+static atomic_uint val_home_next;
+static __thread int val_home = -1;
+
+static bool
+lru_val_init(lru_t *lru)
+{
+  struct lru_val_shard *shard;
+
+  lru->val_shards = calloc(LRU_VAL_CLASSES * LRU_VAL_SHARDS,
+                           sizeof(struct lru_val_shard));
+  if (!lru->val_shards)
+    return false;
+  for (int i = 0; i < LRU_VAL_CLASSES * LRU_VAL_SHARDS; i++)
+    {
+      shard = &lru->val_shards[i];
+      pthread_mutex_init(&shard->lock, NULL);
+      shard->slot_size = LRU_VAL_CLASS_SIZE(i / LRU_VAL_SHARDS);
+    }
+  return true;
+}
+
+// Unmap the pages of every value class, once no item is left in them
+static void
+lru_val_cleanup(lru_t *lru)
+{
+  struct lru_val_shard *shard;
+  struct lru_val_page *page;
+
+  for (int i = 0; i < LRU_VAL_CLASSES * LRU_VAL_SHARDS; i++)
+    {
+      shard = &lru->val_shards[i];
+      while ((page = shard->pages))
+        {
+          shard->pages = page->next;
+          munmap(page, LRU_VAL_PAGE_SIZE);
+        }
+      pthread_mutex_destroy(&shard->lock);
+    }
+  free(lru->val_shards);
+}
+
+// A page of value slots aligned to its size, so that a slot finds its
+// shard in the first slot of its page.
+static struct lru_val_page *
+lru_val_page_map(void)
+{
+  uint8_t *ptr, *page;
+  size_t head;
+
+  ptr = mmap(NULL, 2 * LRU_VAL_PAGE_SIZE, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (ptr == MAP_FAILED)
+    return NULL;
+  page = (uint8_t *)(((uintptr_t)ptr + LRU_VAL_PAGE_SIZE - 1)
+                     & ~(uintptr_t)(LRU_VAL_PAGE_SIZE - 1));
+  head = page - ptr;
+  if (head)
+    munmap(ptr, head);
+  munmap(page + LRU_VAL_PAGE_SIZE, LRU_VAL_PAGE_SIZE - head);
+  return (struct lru_val_page *)page;
+}
+
+// Room for an out of line value of vallen bytes: a slot of its value
+// class, from the shard of the calling thread, or a slab chunk above
+// LRU_VAL_CLASS_MAX. NULL if out of memory.
+static void *
+lru_val_alloc(lru_t *lru, size_t vallen)
+{
+  struct lru_val_shard *shard;
+  struct lru_val_page *page;
+  void *slot;
+  int cls;
+
+  cls = lru_val_class(vallen);
+  if (cls == LRU_VAL_CLASSES)
+    return slab_alloc(vallen);
+  if (val_home < 0)
+    val_home = atomic_fetch_add_explicit(&val_home_next, 1,
+                                         memory_order_relaxed)
+               % LRU_VAL_SHARDS;
+  shard = &lru->val_shards[cls * LRU_VAL_SHARDS + val_home];
+
+  pthread_mutex_lock(&shard->lock);
+  slot = shard->free_list;
+  if (slot)
+    shard->free_list = *(void **)slot;
+  else
+    {
+      if (!shard->page_left)
+        {
+          page = lru_val_page_map();
+          if (!page)
+            {
+              pthread_mutex_unlock(&shard->lock);
+              syslog(LOG_ERR, "cannot map a page of %zu byte value slots",
+                     shard->slot_size);
+              return NULL;
+            }
+          page->next = shard->pages;
+          page->shard = shard;
+          shard->pages = page;
+          shard->page = (uint8_t *)page + shard->slot_size;
+          shard->page_left = LRU_VAL_PAGE_SIZE / shard->slot_size - 1;
+        }
+      slot = shard->page;
+      shard->page += shard->slot_size;
+      shard->page_left--;
+    }
+  pthread_mutex_unlock(&shard->lock);
+  atomic_fetch_add_explicit(&lru->val_slots[cls], 1, memory_order_relaxed);
+  return slot;
+}
+
+// Give a value back to the shard its slot came from, or to the slab
+static void
+lru_val_free(lru_t *lru, void *ptr, size_t vallen)
+{
+  struct lru_val_shard *shard;
+  int cls;
+
+  if (!ptr)
+    return;
+  cls = lru_val_class(vallen);
+  if (cls == LRU_VAL_CLASSES)
+    {
+      slab_free(ptr, vallen);
+      return;
+    }
+  shard = ((struct lru_val_page *)((uintptr_t)ptr
+                                   & ~(uintptr_t)(LRU_VAL_PAGE_SIZE - 1)))
+              ->shard;
+  pthread_mutex_lock(&shard->lock);
+  *(void **)ptr = shard->free_list;
+  shard->free_list = ptr;
+  pthread_mutex_unlock(&shard->lock);
+  atomic_fetch_sub_explicit(&lru->val_slots[cls], 1, memory_order_relaxed);
+}
+
+// synchronize_rcu followed by rcu_barrier. Neither may run from an
+// online QSBR thread.
+static void
+lru_quiesce(void)
+{
+  bool online;
+
+  online = rcu_read_ongoing();
+  if (online)
+    rcu_thread_offline();
+  synchronize_rcu();
+  rcu_barrier();
+  if (online)
+    rcu_thread_online();
+}
+
+static atomic_ullong lru_next_id = 1;
+
+// txids reserved by the calling thread, [next, end)
+struct lru_txids
+{
+  uint64_t lru_id;
+  uint64_t next;
+  uint64_t end;
+  // hits that did not refresh the recency, not yet added to the lru
+  uint64_t skipped;
+  // hits not yet added to lru_t.node_hits
+  uint64_t hits;
+};
+static __thread struct lru_txids lru_txids;
+
+// A unique txid for a write, without touching the shared clock most of
+// the time.
+static inline uint64_t
+lru_next_txid(lru_t *lru)
+{
+  uint64_t clock;
+
+  clock = atomic_load_explicit(&lru->txid, memory_order_relaxed);
+  if (lru_txids.lru_id != lru->id || lru_txids.next == lru_txids.end
+      || clock - lru_txids.end > LRU_TXID_STALE)
+    {
+      if (lru_txids.lru_id != lru->id)
+        lru_txids.skipped = lru_txids.hits = 0;
+      lru_txids.lru_id = lru->id;
+      lru_txids.next = atomic_fetch_add_explicit(&lru->txid, LRU_TXID_BATCH,
+                                                 memory_order_relaxed);
+      lru_txids.end = lru_txids.next + LRU_TXID_BATCH;
+    }
+  return lru_txids.next++;
+}
+
+// Refresh the recency of a hit bucket unless it is within the touch
+// window of the clock. Skipping spares a write to a line all readers of
+// a hot key share.
+static inline void
+lru_touch_bucket(lru_t *lru, struct bucket *bucket)
+{
+  uint64_t clock;
+
+  clock = atomic_load_explicit(&lru->txid, memory_order_relaxed);
+  if (bucket->txid + lru->touch_window < clock)
+    {
+      bucket->txid = clock;
+      return;
+    }
+  if (lru_txids.lru_id != lru->id)
+    {
+      lru_txids.lru_id = lru->id;
+      lru_txids.next = lru_txids.end = 0;
+      lru_txids.skipped = lru_txids.hits = 0;
+    }
+  if (++lru_txids.skipped == LRU_TXID_BATCH)
+    {
+      atomic_fetch_add_explicit(&lru->touch_skipped, LRU_TXID_BATCH,
+                                memory_order_relaxed);
+      lru_txids.skipped = 0;
+    }
+}
+
+// Count a hit on the node the thread runs on, LRU_TXID_BATCH at a time.
+// The node is looked up once per batch.
+static inline void
+lru_count_hit(lru_t *lru)
+{
+  unsigned int cpu, node;
+
+  if (lru_txids.lru_id != lru->id)
+    {
+      lru_txids.lru_id = lru->id;
+      lru_txids.next = lru_txids.end = 0;
+      lru_txids.skipped = lru_txids.hits = 0;
+    }
+  if (++lru_txids.hits < LRU_TXID_BATCH)
+    return;
+  if (syscall(SYS_getcpu, &cpu, &node, NULL))
+    node = 0;
+  atomic_fetch_add_explicit(&lru->node_hits[node % LRU_NUMA_NODES],
+                            LRU_TXID_BATCH, memory_order_relaxed);
+  lru_txids.hits = 0;
+}
+
+lru_t *
+lru_init(uint64_t num_objects, size_t inline_keylen, size_t inline_vallen)
+{
+  lru_t *lru;
+
+  lru = calloc(sizeof(lru_t), 1);
 
   inline_keylen = inline_keylen > 8 ? inline_keylen : 8;
   inline_vallen = inline_vallen > 8 ? inline_vallen : 8;
 
-  bucket_size = sizeof(struct bucket) + inline_keylen + inline_vallen;
-  ibucket_size = sizeof(struct inner_bucket) + inline_keylen + inline_vallen;
-
-  lru->capacity_clz = capacity_clz;
-  lru->capacity_ms4b = capacity_ms4b;
   lru->inline_keylen = inline_keylen;
   lru->inline_vallen = inline_vallen;
-  lru->buckets = calloc(bucket_size, capacity);
-  lru->tmp_buckets = calloc(ibucket_size, 64);
+  lru->table = lru_table_new(
+      num_objects, lru_bucket_size(inline_keylen, inline_vallen));
+  if (!lru->table)
+    {
+      free(lru);
+      return NULL;
+    }
+  if (!lru_val_init(lru))
+    {
+      lru_table_free(lru->table);
+      free(lru);
+      return NULL;
+    }
+  lru->tmp_shards = calloc(LRU_TMP_SHARDS, sizeof(struct lru_tmp_shard));
+  lru->id = atomic_fetch_add_explicit(&lru_next_id, 1, memory_order_relaxed);
   lru->txid = 1;
+  lru->touch_window = LRU_TOUCH_WINDOW;
 
   return lru;
 }
 
 swiper_t *
-swiper_init(lru_t *lru, uint32_t pq_size)
+swiper_init(lru_t *lru)
 {
-  size_t swiper_size;
-  swiper_size = sizeof(swiper_t) + pq_size * sizeof(uint64_t[2]);
-  swiper_t *swiper = calloc(1, swiper_size);
+  swiper_t *swiper = calloc(1, sizeof(swiper_t));
   swiper->lru = lru;
-  swiper->pqueue_size = pq_size;
+  swiper->nparts = 1;
+  swiper->rand_state = (uintptr_t)swiper | 1;
   return swiper;
 }
 
-void
-lru_cleanup(lru_t *lru)
+void
+lru_cleanup(lru_t *lru)
+{
+  size_t inline_keylen, inline_vallen, bucket_size;
+  uint64_t capacity;
+  int shard;
+  uint8_t *buckets, magic, new_magic;
+  struct bucket *bucket;
+  void *keyptr, *valptr;
+
+  // Finish a resize in progress
+  while (!lru_migrate(lru, UINT64_MAX))
+    ;
+  lru_resize_end(lru);
+
+  inline_keylen = lru->inline_keylen;
+  inline_vallen = lru->inline_vallen;
+  bucket_size = lru_bucket_size(inline_keylen, inline_vallen);
+  buckets = lru->table->buckets;
+  capacity = lru_table_capacity(lru->table);
+
+  // Run the pending reclamations. Committing an update queues another
+  // callback, hence the loop.
+  while (atomic_load_explicit(&lru->deferred_cnt, memory_order_acquire))
+    lru_quiesce();
+
+  for (size_t idx = 0; idx < capacity; idx++)
+    {
+      bucket = (struct bucket *)&buckets[bucket_size * idx];
+      while (true)
+        {
+          magic = atomic_load_explicit(&bucket->magic, memory_order_acquire);
+          if (magic == 0x00 || magic == 0x02)
+            goto next_loop;
+          if (magic == 0x80 || magic == 0x81 || magic == 0x82
+              || (magic & 0x3) == 0x3)
+            continue;
+          new_magic = 0x82;
+          if (atomic_compare_exchange_strong_explicit(
+                  &bucket->magic, &magic, new_magic, memory_order_acq_rel,
+                  memory_order_acquire))
+            break;
+        }
+      if (bucket->ibucket.keylen > inline_keylen)
+        {
+          keyptr = *((void **)&bucket->ibucket.data[0]);
+          slab_free(keyptr, bucket->ibucket.keylen);
+          atomic_fetch_sub_explicit(&lru->ninline_keycnt, 1,
+                                    memory_order_relaxed);
+          atomic_fetch_sub_explicit(&lru->ninline_keylen,
+                                    bucket->ibucket.keylen,
+                                    memory_order_relaxed);
+          lru_out_sub(lru, slab_chunk_size(bucket->ibucket.keylen));
+        }
+      else
+        {
+          atomic_fetch_sub_explicit(&lru->inline_acc_keylen,
+                                    bucket->ibucket.keylen,
+                                    memory_order_relaxed);
+        }
+      if (!bucket->ibucket.is_numeric_val)
+        {
+          if (bucket->ibucket.vallen > inline_vallen)
+            {
+              valptr = *((void **)&bucket->ibucket.data[inline_keylen]);
+              lru_val_free(lru, valptr, bucket->ibucket.vallen);
+              atomic_fetch_sub_explicit(&lru->ninline_valcnt, 1,
+                                        memory_order_relaxed);
+              atomic_fetch_sub_explicit(&lru->ninline_vallen,
+                                        bucket->ibucket.vallen,
+                                        memory_order_relaxed);
+              lru_out_sub(lru, lru_val_size(bucket->ibucket.vallen));
+            }
+          else
+            {
+              atomic_fetch_sub_explicit(&lru->inline_acc_vallen,
+                                        bucket->ibucket.vallen,
+                                        memory_order_relaxed);
+            }
+        }
+      atomic_fetch_sub_explicit(&lru->objcnt, 1, memory_order_relaxed);
+      atomic_store_explicit(&bucket->magic, 0x02, memory_order_release);
+    next_loop:
+      (void)0;
+    }
+  lru_table_free(lru->table);
+  for (shard = 0; shard < LRU_TMP_SHARDS; shard++)
+    free(lru->tmp_shards[shard].buckets);
+  free(lru->tmp_shards);
+  lru_val_cleanup(lru);
+}
+
+// Each thread starts looking for a tmp bucket in its own shard.
+static atomic_uint tmp_home_next;
+static __thread int tmp_home = -1;
+
+static inline struct inner_bucket *
+lru_tmpbucket(lru_t *lru, uint16_t idx, size_t ibucket_size)
+{
+  return (struct inner_bucket *)&lru->tmp_shards[idx / LRU_TMP_SHARD_SIZE]
+      .buckets[ibucket_size * (idx % LRU_TMP_SHARD_SIZE)];
+}
+
+// Take a free tmp bucket, from the home shard of the calling thread
+// unless it is full. Shards are allocated the first time they are
+// needed and never freed before lru_cleanup, a shard that cannot be
+// allocated is skipped. Returns NULL when no tmp bucket is free.
+struct inner_bucket *
+alloc_tmpbucket(lru_t *lru, uint16_t *idx)
+{
+  size_t inline_keylen, inline_vallen, ibucket_size;
+  uint64_t bmap, new_bmap;
+  uint8_t *buckets, *expected;
+  struct lru_tmp_shard *tmp_shard;
+  int bmbit, shard;
+
+  inline_keylen = lru->inline_keylen;
+  inline_vallen = lru->inline_vallen;
+  ibucket_size = sizeof(struct inner_bucket) + inline_keylen + inline_vallen;
+
+  if (tmp_home < 0)
+    tmp_home = atomic_fetch_add_explicit(&tmp_home_next, 1,
+                                         memory_order_relaxed)
+               % LRU_TMP_SHARDS;
+
+  for (int i = 0; i < LRU_TMP_SHARDS; i++)
+    {
+      shard = (tmp_home + i) % LRU_TMP_SHARDS;
+      tmp_shard = &lru->tmp_shards[shard];
+      buckets = atomic_load_explicit(&tmp_shard->buckets,
+                                     memory_order_acquire);
+      if (!buckets)
+        {
+          buckets = malloc(ibucket_size * LRU_TMP_SHARD_SIZE);
+          if (!buckets)
+            continue;
+          expected = NULL;
+          if (!atomic_compare_exchange_strong_explicit(
+                  &tmp_shard->buckets, &expected, buckets,
+                  memory_order_acq_rel, memory_order_acquire))
+            {
+              free(buckets);
+              buckets = expected;
+            }
+        }
+      bmap = atomic_load_explicit(&tmp_shard->bmap, memory_order_acquire);
+      do
+        {
+          if (!(~bmap))
+            break;
+          new_bmap = bmap + 1;
+          bmbit = __builtin_ctzl(new_bmap);
+          new_bmap |= bmap;
+        }
+      while (!atomic_compare_exchange_weak_explicit(
+          &tmp_shard->bmap, &bmap, new_bmap, memory_order_acq_rel,
+          memory_order_acquire));
+      if (!(~bmap))
+        continue;
+      *idx = shard * LRU_TMP_SHARD_SIZE + bmbit;
+      return (struct inner_bucket *)&buckets[ibucket_size * bmbit];
+    }
+  return NULL;
+}
+
+void
+free_tmpbucket(lru_t *lru, uint16_t idx)
+{
+  atomic_fetch_and_explicit(&lru->tmp_shards[idx / LRU_TMP_SHARD_SIZE].bmap,
+                            ~(1ULL << (idx % LRU_TMP_SHARD_SIZE)),
+                            memory_order_release);
+}
+
+static inline uint64_t
+fast_mod_scale(uint64_t probed_hash, uint64_t mask, uint64_t scale)
+{
+  return (probed_hash & mask) * scale >> 4;
+}
+
+// The inner bucket readers see for a bucket in state magic.
+static inline struct inner_bucket *
+lru_ibucket(lru_t *lru, struct bucket *bucket, uint8_t magic,
+            size_t ibucket_size)
+{
+  uint16_t tmp_idx;
+  if ((magic & 0x3) == 0x3)
+    {
+      tmp_idx = atomic_load_explicit(&bucket->tmp_idx, memory_order_acquire);
+      return lru_tmpbucket(lru, tmp_idx, ibucket_size);
+    }
+  return &bucket->ibucket;
+}
+
+static inline bool
+lru_ibucket_keyeq(lru_t *lru, struct inner_bucket *ibucket, cmd_handler *cmd)
+{
+  size_t keylen = cmd->req.keylen;
+  void *keyptr;
+
+  if (ibucket->keylen != keylen)
+    return false;
+  keyptr = keylen > lru->inline_keylen ? *((void **)&ibucket->data[0])
+                                       : &ibucket->data[0];
+  return memeq(keyptr, cmd->key, keylen);
+}
+
+static void
+lru_release_tmpbucket_cb(struct rcu_head *head)
+{
+  struct lru_deferred *deferred
+      = caa_container_of(head, struct lru_deferred, head);
+  lru_t *lru = deferred->lru;
+
+  free_tmpbucket(lru, deferred->tmp_idx);
+  free(deferred);
+  atomic_fetch_sub_explicit(&lru->deferred_cnt, 1, memory_order_release);
+}
+
+// No reader looks at the bucket anymore, only at the tmp bucket. Copy
+// the tmp bucket back and let readers return to the bucket. If the tmp
+// bucket was replaced by a later update or the item was deleted, the
+// tmp bucket is only released.
+static void
+lru_commit_update_cb(struct rcu_head *head)
+{
+  struct lru_deferred *deferred
+      = caa_container_of(head, struct lru_deferred, head);
+  lru_t *lru = deferred->lru;
+  struct bucket *bucket = deferred->bucket;
+  size_t ibucket_size;
+  uint8_t magic;
+
+  ibucket_size = sizeof(struct inner_bucket) + lru->inline_keylen
+                 + lru->inline_vallen;
+  // A bucket in any other state than 0x03 or 0x83 was already committed
+  // by a later update or deleted. While a writer holds it, try again
+  // after another grace period rather than hold up the callbacks queued
+  // behind this one.
+  magic = 0x03;
+  if (!atomic_compare_exchange_strong_explicit(&bucket->magic, &magic, 0x83,
+                                               memory_order_acq_rel,
+                                               memory_order_acquire)
+      && magic == 0x83)
+    {
+      call_rcu(&deferred->head, lru_commit_update_cb);
+      return;
+    }
+  if (magic == 0x03)
+    {
+      if (atomic_load_explicit(&bucket->tmp_idx, memory_order_relaxed)
+          == deferred->tmp_idx)
+        {
+          memcpy(&bucket->ibucket,
+                 lru_tmpbucket(lru, deferred->tmp_idx, ibucket_size),
+                 ibucket_size);
+          magic = 1;
+        }
+      atomic_store_explicit(&bucket->magic, magic, memory_order_release);
+    }
+  lru_val_free(lru, deferred->valptr, deferred->vallen);
+  deferred->valptr = NULL;
+  call_rcu(&deferred->head, lru_release_tmpbucket_cb);
+}
+
+static void
+lru_reclaim_bucket_cb(struct rcu_head *head)
+{
+  struct lru_deferred *deferred
+      = caa_container_of(head, struct lru_deferred, head);
+  lru_t *lru = deferred->lru;
+
+  uint8_t magic = 0x42;
+
+  slab_free(deferred->keyptr, deferred->keylen);
+  lru_val_free(lru, deferred->valptr, deferred->vallen);
+  // A resize may have sealed the bucket meanwhile
+  if (atomic_compare_exchange_strong_explicit(&deferred->bucket->magic,
+                                              &magic, 2, memory_order_acq_rel,
+                                              memory_order_relaxed))
+    atomic_fetch_add_explicit(&lru->tombstones, 1, memory_order_relaxed);
+  free(deferred);
+  atomic_fetch_sub_explicit(&lru->deferred_cnt, 1, memory_order_release);
+}
+
+static struct lru_deferred *
+lru_deferred_alloc(lru_t *lru, struct bucket *bucket)
+{
+  struct lru_deferred *deferred = calloc(1, sizeof(struct lru_deferred));
+  deferred->lru = lru;
+  deferred->bucket = bucket;
+  atomic_fetch_add_explicit(&lru->deferred_cnt, 1, memory_order_relaxed);
+  return deferred;
+}
+
+// Remove the item of a bucket locked with magic 0x82, whose current
+// version is ibucket. The accounting is done right away, the memory is
+// reclaimed once the readers still looking at the item are gone.
+static void
+lru_retire_bucket(lru_t *lru, struct bucket *bucket,
+                  struct inner_bucket *ibucket)
+{
+  size_t inline_keylen, inline_vallen, keylen, vallen;
+  uint16_t probe;
+  struct lru_deferred *deferred;
+
+  inline_keylen = lru->inline_keylen;
+  inline_vallen = lru->inline_vallen;
+  deferred = lru_deferred_alloc(lru, bucket);
+
+  keylen = ibucket->keylen;
+  vallen = ibucket->vallen;
+  probe = ibucket->probe;
+  atomic_fetch_sub_explicit(&lru->probe_stats[probe], 1, memory_order_relaxed);
+  if (keylen > inline_keylen)
+    {
+      atomic_fetch_sub_explicit(&lru->ninline_keycnt, 1, memory_order_relaxed);
+      atomic_fetch_sub_explicit(&lru->ninline_keylen, keylen,
+                                memory_order_relaxed);
+      lru_out_sub(lru, slab_chunk_size(keylen));
+      deferred->keyptr = *((void **)&ibucket->data[0]);
+      deferred->keylen = keylen;
+    }
+  else
+    {
+      atomic_fetch_sub_explicit(&lru->inline_acc_keylen, keylen,
+                                memory_order_relaxed);
+    }
+  if (!ibucket->is_numeric_val)
+    {
+      if (vallen > inline_vallen)
+        {
+          atomic_fetch_sub_explicit(&lru->ninline_valcnt, 1,
+                                    memory_order_relaxed);
+          atomic_fetch_sub_explicit(&lru->ninline_vallen, vallen,
+                                    memory_order_relaxed);
+          lru_out_sub(lru, lru_val_size(vallen));
+          deferred->valptr = *(void **)&ibucket->data[inline_keylen];
+          deferred->vallen = vallen;
+        }
+      else
+        {
+          atomic_fetch_sub_explicit(&lru->inline_acc_vallen, vallen,
+                                    memory_order_relaxed);
+        }
+    }
+
+  atomic_fetch_sub_explicit(&lru->objcnt, 1, memory_order_relaxed);
+  atomic_store_explicit(&bucket->magic, 0x42, memory_order_release);
+  call_rcu(&deferred->head, lru_reclaim_bucket_cb);
+}
+
+// Insert a copy of an item moved out of the old table. The key cannot
+// be in table yet, writers move an item before they touch it.
+static bool
+lru_table_insert_ibucket(lru_t *lru, lru_table *table,
+                         struct inner_bucket *src, uint64_t txid)
+{
+  size_t inline_keylen, inline_vallen, ibucket_size, bucket_size, keylen;
+  uint64_t capacity, hashed_key, probing_key, mask, up32key, idx, idx_next;
+  uint32_t longest_probes;
+  uint8_t *buckets, magic;
+  struct bucket *bucket;
+  void *keyptr;
+
+  inline_keylen = lru->inline_keylen;
+  inline_vallen = lru->inline_vallen;
+  bucket_size = lru_bucket_size(inline_keylen, inline_vallen);
+  ibucket_size = sizeof(struct inner_bucket) + inline_keylen + inline_vallen;
+  buckets = table->buckets;
+
+  keylen = src->keylen;
+  keyptr = keylen > inline_keylen ? *((void **)&src->data[0])
+                                  : &src->data[0];
+  capacity = lru_table_capacity(table);
+  mask = (1ULL << (64 - table->capacity_clz)) - 1;
+  hashed_key = cityhash64((uint8_t *)keyptr, keylen);
+  up32key = hashed_key >> 32;
+
+  probing_key = hashed_key;
+  idx = fast_mod_scale(probing_key, mask, table->capacity_ms4b);
+  probing_key += up32key;
+  idx_next = fast_mod_scale(probing_key, mask, table->capacity_ms4b);
+  for (int probe = 0; probe < PROBE_STATS_SIZE; probe++)
+    {
+      int i = 0;
+      while (true)
+        {
+          bucket = (struct bucket *)&buckets[idx * bucket_size];
+          magic = atomic_load_explicit(&bucket->magic, memory_order_acquire);
+          if ((magic == 0 || magic == 2)
+              && atomic_compare_exchange_strong_explicit(
+                  &bucket->magic, &magic, magic | 0x80, memory_order_acq_rel,
+                  memory_order_acquire))
+            {
+              if (magic == 2)
+                atomic_fetch_sub_explicit(&lru->tombstones, 1,
+                                          memory_order_relaxed);
+              memcpy(&bucket->ibucket, src, ibucket_size);
+              bucket->ibucket.probe = probe;
+              bucket->txid = txid;
+              lru_set_tag(table, idx, lru_tag(hashed_key));
+              atomic_store_explicit(&bucket->magic, 1, memory_order_release);
+              atomic_fetch_sub_explicit(&lru->probe_stats[src->probe], 1,
+                                        memory_order_relaxed);
+              atomic_fetch_add_explicit(&lru->probe_stats[probe], 1,
+                                        memory_order_relaxed);
+
+              longest_probes = atomic_load_explicit(&table->longest_probes,
+                                                    memory_order_acquire);
+              do
+                {
+                  if (probe <= longest_probes)
+                    break;
+                }
+              while (!atomic_compare_exchange_strong_explicit(
+                  &table->longest_probes, &longest_probes, probe,
+                  memory_order_release, memory_order_relaxed));
+              return true;
+            }
+          if (++i == 4)
+            break;
+          idx++;
+          if (idx >= capacity)
+            idx = 0;
+          probe++;
+        }
+      idx = idx_next;
+      probing_key += up32key;
+      idx_next = fast_mod_scale(probing_key, mask, table->capacity_ms4b);
+    }
+  return false;
+}
+
+// Move the item of a bucket of the old table into table and mark the
+// bucket as moved. A free bucket is sealed the same way, so that a
+// writer that did not notice the resize yet cannot insert behind the
+// migration; it retries on the new table instead.
+static void
+lru_migrate_bucket(lru_t *lru, lru_table *table, struct bucket *bucket)
+{
+  size_t ibucket_size;
+  struct inner_bucket *ibucket;
+  uint8_t magic;
+
+  ibucket_size = sizeof(struct inner_bucket) + lru->inline_keylen
+                 + lru->inline_vallen;
+  while (true)
+    {
+      magic = atomic_load_explicit(&bucket->magic, memory_order_acquire);
+      switch (magic)
+        {
+        case 0x06:
+          return;
+        case 0x00:
+        case 0x02:
+        case 0x42:
+          if (atomic_compare_exchange_strong_explicit(
+                  &bucket->magic, &magic, 0x06, memory_order_acq_rel,
+                  memory_order_acquire))
+            {
+              if (magic == 0x02)
+                atomic_fetch_sub_explicit(&lru->tombstones, 1,
+                                          memory_order_relaxed);
+              return;
+            }
+          continue;
+        case 0x01:
+        case 0x03:
+          if (!atomic_compare_exchange_strong_explicit(
+                  &bucket->magic, &magic, magic | 0x80, memory_order_acq_rel,
+                  memory_order_acquire))
+            continue;
+          break;
+        default:
+          // locked by another writer
+          continue;
+        }
+      // Readers keep reading the locked bucket until it is marked as
+      // moved, by then the copy in the new table is visible.
+      ibucket = lru_ibucket(lru, bucket, magic, ibucket_size);
+      if (lru_table_insert_ibucket(lru, table, ibucket, bucket->txid))
+        {
+          atomic_store_explicit(&bucket->magic, 0x06, memory_order_release);
+          return;
+        }
+      // No room in the new table, evict the item. The bucket is sealed
+      // on the next iteration.
+      atomic_store_explicit(&bucket->magic, 0x82, memory_order_release);
+      lru_retire_bucket(lru, bucket, ibucket);
+    }
+}
+
+// Move the item of cmd out of the old table before a writer touches
+// the new table. Every free bucket on the way is sealed, so that a
+// writer that did not notice the resize cannot insert the same key
+// into the old table meanwhile.
+static void
+lru_migrate_key(lru_t *lru, lru_table *old_table, lru_table *table,
+                cmd_handler *cmd, uint64_t hashed_key)
 {
   size_t inline_keylen, inline_vallen, ibucket_size, bucket_size;
-  uint64_t capacity;
-  uint8_t *buckets, magic, new_magic;
+  uint64_t capacity, probing_key, mask, up32key, idx, idx_next;
+  uint8_t *buckets, magic;
   struct bucket *bucket;
-  void *keyptr, *valptr;
+  struct inner_bucket *ibucket;
 
   inline_keylen = lru->inline_keylen;
   inline_vallen = lru->inline_vallen;
-  bucket_size = sizeof(struct bucket) + inline_keylen + inline_vallen;
+  bucket_size = lru_bucket_size(inline_keylen, inline_vallen);
   ibucket_size = sizeof(struct inner_bucket) + inline_keylen + inline_vallen;
-  buckets = lru->buckets;
-  capacity = lru_capacity_(lru->capacity_clz, lru->capacity_ms4b);
+  buckets = old_table->buckets;
 
-  for (size_t idx = 0; idx < capacity; idx++)
+  capacity = lru_table_capacity(old_table);
+  mask = (1ULL << (64 - old_table->capacity_clz)) - 1;
+  up32key = hashed_key >> 32;
+
+  probing_key = hashed_key;
+  idx = fast_mod_scale(probing_key, mask, old_table->capacity_ms4b);
+  probing_key += up32key;
+  idx_next = fast_mod_scale(probing_key, mask, old_table->capacity_ms4b);
+  for (int probe = 0; probe < PROBE_STATS_SIZE; probe++)
     {
-      bucket = (struct bucket *)&buckets[bucket_size * idx];
+      int i = 0;
       while (true)
         {
+          bucket = (struct bucket *)&buckets[idx * bucket_size];
           magic = atomic_load_explicit(&bucket->magic, memory_order_acquire);
-          if (magic == 0x00 || magic == 0x02)
-            goto next_loop;
-          if (magic == 0x80 || magic == 0x82 || (magic & 0x3) == 0x3)
-            continue;
-          new_magic = 0x82;
-          if (atomic_compare_exchange_strong_explicit(
-                  &bucket->magic, &magic, new_magic, memory_order_acq_rel,
-                  memory_order_acquire))
-            break;
-        }
-      if (bucket->ibucket.keylen > inline_keylen)
-        {
-          keyptr = *((void **)&bucket->ibucket.data[0]);
-          free(keyptr);
-          atomic_fetch_sub_explicit(&lru->ninline_keycnt, 1,
-                                    memory_order_relaxed);
-          atomic_fetch_sub_explicit(&lru->ninline_keylen,
-                                    bucket->ibucket.keylen,
-                                    memory_order_relaxed);
-        }
-      else
-        {
-          atomic_fetch_sub_explicit(&lru->inline_acc_keylen,
-                                    bucket->ibucket.keylen,
-                                    memory_order_relaxed);
-        }
-      if (!bucket->ibucket.is_numeric_val)
-        {
-          if (bucket->ibucket.vallen > inline_vallen)
-            {
-              valptr = *((void **)&bucket->ibucket.data[inline_keylen]);
-              free(valptr);
-              atomic_fetch_sub_explicit(&lru->ninline_valcnt, 1,
-                                        memory_order_relaxed);
-              atomic_fetch_sub_explicit(&lru->ninline_vallen,
-                                        bucket->ibucket.vallen,
-                                        memory_order_relaxed);
-            }
-          else
+          switch (magic)
             {
-              atomic_fetch_sub_explicit(&lru->inline_acc_vallen,
-                                        bucket->ibucket.vallen,
-                                        memory_order_relaxed);
+            case 0x00:
+            case 0x02:
+            case 0x42:
+              if (!atomic_compare_exchange_strong_explicit(
+                      &bucket->magic, &magic, 0x06, memory_order_acq_rel,
+                      memory_order_acquire))
+                continue;
+              if (magic == 0x00)
+                return;
+              if (magic == 0x02)
+                atomic_fetch_sub_explicit(&lru->tombstones, 1,
+                                          memory_order_relaxed);
+              goto next_iter;
+            case 0x06:
+              goto next_iter;
+            case 0x80:
+            case 0x82:
+              continue;
+            default:
+              break;
             }
+          ibucket = lru_ibucket(lru, bucket, magic, ibucket_size);
+          if (!lru_ibucket_keyeq(lru, ibucket, cmd))
+            goto next_iter;
+          lru_migrate_bucket(lru, table, bucket);
+          return;
+        next_iter:
+          if (++i == 4)
+            break;
+          idx++;
+          if (idx >= capacity)
+            idx = 0;
+          probe++;
         }
-      atomic_fetch_sub_explicit(&lru->objcnt, 1, memory_order_relaxed);
-      atomic_store_explicit(&bucket->magic, 0x02, memory_order_release);
-    next_loop:
-      (void)0;
+      idx = idx_next;
+      probing_key += up32key;
+      idx_next = fast_mod_scale(probing_key, mask, old_table->capacity_ms4b);
     }
-  free(lru->buckets);
-  free(lru->tmp_buckets);
 }
 
-struct inner_bucket *
-alloc_tmpbucket(lru_t *lru, uint8_t *idx)
+// Move up to nbuckets buckets of the old table. Any number of threads
+// may do so concurrently. Returns true once every bucket was moved.
+static bool
+lru_migrate_step(lru_t *lru, lru_table *old_table, lru_table *table,
+                 uint64_t nbuckets)
 {
-  size_t inline_keylen, inline_vallen, ibucket_size;
-  uint64_t bmap, new_bmap;
-  int bmbit;
-
-  inline_keylen = lru->inline_keylen;
-  inline_vallen = lru->inline_vallen;
-  ibucket_size = sizeof(struct inner_bucket) + inline_keylen + inline_vallen;
+  size_t bucket_size;
+  uint64_t capacity, idx;
 
-reload:
-  bmap = atomic_load_explicit(&lru->tmp_bucket_bmap, memory_order_acquire);
-  do
+  bucket_size = lru_bucket_size(lru->inline_keylen, lru->inline_vallen);
+  capacity = lru_table_capacity(old_table);
+  for (; nbuckets; nbuckets--)
     {
-      if (!(~bmap))
-        goto reload;
-      new_bmap = bmap + 1;
-      bmbit = __builtin_ctzl(new_bmap);
-      new_bmap |= bmap;
+      idx = atomic_fetch_add_explicit(&lru->migrate_next, 1,
+                                      memory_order_relaxed);
+      if (idx >= capacity)
+        break;
+      lru_migrate_bucket(
+          lru, table, (struct bucket *)&old_table->buckets[idx * bucket_size]);
+      atomic_fetch_add_explicit(&lru->migrate_done, 1, memory_order_release);
     }
-  while (!atomic_compare_exchange_strong_explicit(
-      &lru->tmp_bucket_bmap, &bmap, new_bmap, memory_order_acq_rel,
-      memory_order_acquire));
-  *idx = bmbit;
-  return (struct inner_bucket *)&lru->tmp_buckets[ibucket_size * bmbit];
+  return atomic_load_explicit(&lru->migrate_done, memory_order_acquire)
+         >= capacity;
 }
 
-void
-free_tmpbucket(lru_t *lru, uint8_t idx)
+bool
+lru_migrate(lru_t *lru, uint64_t nbuckets)
 {
-  atomic_fetch_and_explicit(&lru->tmp_bucket_bmap, ~(1ULL << idx),
-                            memory_order_release);
+  lru_table *table, *old_table;
+
+  lru_tables(lru, &table, &old_table);
+  if (!old_table)
+    return true;
+  return lru_migrate_step(lru, old_table, table, nbuckets);
 }
 
-static inline uint64_t
-fast_mod_scale(uint64_t probed_hash, uint64_t mask, uint64_t scale)
+// Start moving the items to new_table, which is freed on failure
+static bool
+lru_resize_to(lru_t *lru, lru_table *new_table)
 {
-  return (probed_hash & mask) * scale >> 4;
+  lru_table *table, *expected = NULL;
+  uint64_t objcnt;
+  bool online;
+
+  objcnt = atomic_load_explicit(&lru->objcnt, memory_order_relaxed);
+  // Both tables are allocated until the resize ends
+  if (objcnt > LRU_SWIPE_THRESHOLD(lru_table_capacity(new_table))
+      || (lru->mem_limit
+          && lru_mem_used(lru) + lru_table_mem(new_table)
+                 > lru->mem_limit))
+    {
+      lru_table_free(new_table);
+      return false;
+    }
+  // Nobody sees the new table before it is published. Faulting it in
+  // takes a while, grace periods need not wait for it.
+  if (lru->prefault_threads)
+    {
+      online = rcu_read_ongoing();
+      if (online)
+        rcu_thread_offline();
+      lru_table_prefault(new_table, lru->prefault_threads);
+      if (online)
+        rcu_thread_online();
+    }
+  table = atomic_load_explicit(&lru->table, memory_order_acquire);
+  if (!atomic_compare_exchange_strong_explicit(&lru->old_table, &expected,
+                                               table, memory_order_acq_rel,
+                                               memory_order_acquire))
+    {
+      lru_table_free(new_table);
+      return false;
+    }
+  atomic_store_explicit(&lru->migrate_next, 0, memory_order_relaxed);
+  atomic_store_explicit(&lru->migrate_done, 0, memory_order_relaxed);
+  atomic_store_explicit(&lru->table, new_table, memory_order_release);
+  return true;
 }
 
-// The whole lru_get is wrapped by rcu_read_lock()
 bool
-lru_get(lru_t *lru, cmd_handler *cmd, lru_val_t *lru_val)
+lru_resize(lru_t *lru, uint64_t num_objects)
+{
+  lru_table *new_table;
+  size_t bucket_size;
+
+  bucket_size = lru_bucket_size(lru->inline_keylen, lru->inline_vallen);
+  new_table = lru_table_new(num_objects, bucket_size);
+  if (!new_table)
+    return false;
+  return lru_resize_to(lru, new_table);
+}
+
+bool
+lru_compact(lru_t *lru)
+{
+  lru_table *table, *new_table;
+  size_t bucket_size;
+  uint64_t tombstones;
+
+  table = atomic_load_explicit(&lru->table, memory_order_acquire);
+  tombstones = atomic_load_explicit(&lru->tombstones, memory_order_relaxed);
+  if (tombstones < LRU_COMPACT_THRESHOLD(lru_table_capacity(table)))
+    return false;
+  // The new table only gets the live items, the tombstones of the old
+  // one are sealed as they are passed.
+  bucket_size = lru_bucket_size(lru->inline_keylen, lru->inline_vallen);
+  new_table = lru_table_alloc(table->capacity_clz, table->capacity_ms4b,
+                              bucket_size);
+  if (!new_table)
+    return false;
+  return lru_resize_to(lru, new_table);
+}
+
+void
+lru_resize_end(lru_t *lru)
+{
+  lru_table *table, *old_table;
+
+  lru_tables(lru, &table, &old_table);
+  if (!old_table || !lru_migrate_step(lru, old_table, table, 0))
+    return;
+  atomic_store_explicit(&lru->old_table, NULL, memory_order_release);
+  // Nobody looks at the old table after a grace period, and callbacks
+  // queued for its buckets have run after the barrier.
+  lru_quiesce();
+  lru_table_free(old_table);
+}
+
+// Look up cmd in table. The old table of a resize is passed with
+// is_old, in any other table a bucket moved by a resize means that the
+// table was retired meanwhile and sets retry.
+static bool
+lru_table_get(lru_t *lru, lru_table *table, cmd_handler *cmd,
+              lru_val_t *lru_val, uint64_t hashed_key, bool is_old,
+              bool *retry)
 {
-  size_t inline_keylen, inline_vallen, keylen, ibucket_size, bucket_size;
-  uint64_t capacity, hashed_key, probing_key, mask, up32key, idx, idx_next,
-      tmp_idx, txid;
+  size_t inline_keylen, inline_vallen, ibucket_size, bucket_size;
+  uint64_t capacity, probing_key, mask, up32key, idx, idx_next, slot;
   uint32_t longest_probes;
-  uint8_t *buckets, magic;
+  unsigned int candidates;
+  uint8_t *buckets, magic, tag;
   struct bucket *bucket;
   struct inner_bucket *ibucket;
-  void *keyptr;
 
   inline_keylen = lru->inline_keylen;
   inline_vallen = lru->inline_vallen;
-  keylen = cmd->req.keylen;
-  bucket_size = sizeof(struct bucket) + inline_keylen + inline_vallen;
+  bucket_size = lru_bucket_size(inline_keylen, inline_vallen);
   ibucket_size = sizeof(struct inner_bucket) + inline_keylen + inline_vallen;
   longest_probes
-      = atomic_load_explicit(&lru->longest_probes, memory_order_acquire);
-  buckets = lru->buckets;
+      = atomic_load_explicit(&table->longest_probes, memory_order_acquire);
+  buckets = table->buckets;
 
-  capacity = lru_capacity_(lru->capacity_clz, lru->capacity_ms4b);
-  mask = (1ULL << (64 - lru->capacity_clz)) - 1;
-  hashed_key = cityhash64((uint8_t *)cmd->key, keylen);
+  capacity = lru_capacity_(table->capacity_clz, table->capacity_ms4b);
+  mask = (1ULL << (64 - table->capacity_clz)) - 1;
   up32key = hashed_key >> 32;
+  tag = lru_tag(hashed_key);
 
   probing_key = hashed_key;
-  idx = fast_mod_scale(probing_key, mask, lru->capacity_ms4b);
+  idx = fast_mod_scale(probing_key, mask, table->capacity_ms4b);
   probing_key += up32key;
-  idx_next = fast_mod_scale(probing_key, mask, lru->capacity_ms4b);
-  for (int probe = 0; probe <= longest_probes; probe++)
+  idx_next = fast_mod_scale(probing_key, mask, table->capacity_ms4b);
+  // A probe group is 4 buckets, only the ones whose tag matches are
+  // looked at.
+  for (int probe = 0; probe <= longest_probes; probe += 4)
     {
-      int i = 0;
-      __builtin_prefetch(&buckets[idx_next * bucket_size], 0, 0);
-      while (true)
+      __builtin_prefetch(&table->tags[idx_next], 0, 0);
+      candidates = lru_tag_candidates(table, idx, capacity, tag);
+      for (; candidates; candidates &= candidates - 1)
         {
-          bucket = (struct bucket *)&buckets[idx * bucket_size];
+          slot = idx + __builtin_ctz(candidates);
+          if (slot >= capacity)
+            slot -= capacity;
+          bucket = (struct bucket *)&buckets[slot * bucket_size];
           magic = atomic_load_explicit(&bucket->magic, memory_order_acquire);
           if ((magic & 0x3) == 0)
             {
               lru_val->rescode = PROTOCOL_BINARY_RESPONSE_KEY_ENOENT;
               return false;
             }
-          if ((magic & 0x3) == 2)
-            goto next_iter;
-          if (magic == 1)
+          if (magic == 0x06 && !is_old)
             {
-              if (bucket->ibucket.keylen != keylen)
-                goto next_iter;
-              keyptr = keylen > inline_keylen
-                           ? *((void **)&bucket->ibucket.data[0])
-                           : &bucket->ibucket.data[0];
-              if (!memeq(keyptr, cmd->key, keylen))
-                goto next_iter;
-              txid = atomic_load_explicit(&lru->txid, memory_order_relaxed);
-              bucket->txid = txid;
-              lru_val->rescode = PROTOCOL_BINARY_RESPONSE_SUCCESS;
-              lru_val->is_numeric_val = bucket->ibucket.is_numeric_val;
-              lru_val->vallen = bucket->ibucket.vallen;
-              if (!lru_val->is_numeric_val)
-                {
-                  lru_val->value
-                      = lru_val->vallen > inline_vallen
-                            ? *((void **)&bucket->ibucket.data[inline_keylen])
-                            : &bucket->ibucket.data[inline_keylen];
-                }
-              lru_val->cas = bucket->ibucket.cas;
-              lru_val->flags = bucket->ibucket.flags;
-              return true;
+              *retry = true;
+              return false;
             }
-          else
+          if ((magic & 0x3) == 2)
+            continue;
+          // Occupied, or being updated in which case the current
+          // version of the item lives in a tmp bucket.
+          ibucket = lru_ibucket(lru, bucket, magic, ibucket_size);
+          if (!lru_ibucket_keyeq(lru, ibucket, cmd))
+            continue;
+          lru_touch_bucket(lru, bucket);
+          lru_count_hit(lru);
+          // The key never changes in place, the rest of the item is
+          // validated by lru_val_valid once the caller copied it.
+          lru_val->seqp = &bucket->seq;
+          do
+            lru_val->seq
+                = atomic_load_explicit(&bucket->seq, memory_order_acquire);
+          while (lru_val->seq & 1);
+          lru_val->rescode = PROTOCOL_BINARY_RESPONSE_SUCCESS;
+          lru_val->is_numeric_val = ibucket->is_numeric_val;
+          lru_val->vallen = ibucket->vallen;
+          if (!lru_val->is_numeric_val)
             {
-              tmp_idx = magic >> 2;
-              // obtain tmp_bucket
-              ibucket = (struct inner_bucket *)&lru
-                            ->tmp_buckets[tmp_idx * ibucket_size];
-              if (ibucket->keylen != keylen)
-                goto next_iter;
-              keyptr = ibucket->data;
-              if (!memeq(keyptr, cmd->key, keylen))
-                goto next_iter;
-              txid = atomic_load_explicit(&lru->txid, memory_order_relaxed);
-              bucket->txid = txid;
-              lru_val->rescode = PROTOCOL_BINARY_RESPONSE_SUCCESS;
-              lru_val->is_numeric_val = bucket->ibucket.is_numeric_val;
-              lru_val->vallen = ibucket->vallen;
-              if (!lru_val->is_numeric_val)
-                {
-                  lru_val->value
-                      = lru_val->vallen > inline_vallen
-                            ? *((void **)&bucket->ibucket.data[inline_keylen])
-                            : &bucket->ibucket.data[inline_keylen];
-                }
-              lru_val->cas = bucket->ibucket.cas;
-              lru_val->flags = ibucket->flags;
-              return true;
+              lru_val->value = lru_val->vallen > inline_vallen
+                                   ? *((void **)&ibucket->data[inline_keylen])
+                                   : &ibucket->data[inline_keylen];
             }
-        next_iter:
-          if (++i == 4)
-            break;
-          idx++;
-          if (idx >= capacity)
-            idx = 0;
-          probe++;
+          lru_val->cas = ibucket->cas;
+          lru_val->flags = ibucket->flags;
+          return true;
         }
       idx = idx_next;
       probing_key += up32key;
-      idx_next = fast_mod_scale(probing_key, mask, lru->capacity_ms4b);
+      idx_next = fast_mod_scale(probing_key, mask, table->capacity_ms4b);
     }
   lru_val->rescode = PROTOCOL_BINARY_RESPONSE_KEY_ENOENT;
   return false;
 }
 
+// The whole lru_get is wrapped by rcu_read_lock()
 bool
-lru_upsert(lru_t *lru, cmd_handler *cmd, lru_val_t *lru_val)
+lru_get(lru_t *lru, cmd_handler *cmd, lru_val_t *lru_val)
 {
-  size_t inline_keylen, inline_vallen, ibucket_size, bucket_size, keylen;
-  uint64_t capacity, hashed_key, probing_key, mask, up32key, idx, idx_next;
+  lru_table *table, *old_table;
+  uint64_t hashed_key;
+  bool retry;
+
+  hashed_key = cityhash64((uint8_t *)cmd->key, cmd->req.keylen);
+  do
+    {
+      retry = false;
+      lru_tables(lru, &table, &old_table);
+      // The old table is looked at first, an item is inserted into the
+      // new table before it is marked as moved in the old one.
+      if (old_table
+          && lru_table_get(lru, old_table, cmd, lru_val, hashed_key, true,
+                           &retry))
+        return true;
+      if (lru_table_get(lru, table, cmd, lru_val, hashed_key, false, &retry))
+        return true;
+    }
+  while (retry);
+  return false;
+}
+
+bool
+lru_val_valid(lru_val_t *lru_val)
+{
+  atomic_thread_fence(memory_order_acquire);
+  return atomic_load_explicit(lru_val->seqp, memory_order_relaxed)
+         == lru_val->seq;
+}
+
+// Whether cmd can be applied to ibucket in place. Neither the old nor
+// the new value may live out of line, and a value never switches
+// between numeric and string in place, so a reader racing with the
+// write never follows a torn pointer.
+static bool
+lru_inplace_ok(lru_t *lru, struct inner_bucket *ibucket, cmd_handler *cmd)
+{
+  size_t inline_vallen = lru->inline_vallen;
+
+  switch (cmd->req.op)
+    {
+    case PROTOCOL_BINARY_CMD_SET:
+    case PROTOCOL_BINARY_CMD_SETQ:
+    case PROTOCOL_BINARY_CMD_REPLACE:
+    case PROTOCOL_BINARY_CMD_REPLACEQ:
+      return !ibucket->is_numeric_val && ibucket->vallen <= inline_vallen
+             && cmd->value_stored <= inline_vallen;
+    case PROTOCOL_BINARY_CMD_APPEND:
+    case PROTOCOL_BINARY_CMD_APPENDQ:
+    case PROTOCOL_BINARY_CMD_PREPEND:
+    case PROTOCOL_BINARY_CMD_PREPENDQ:
+      return !ibucket->is_numeric_val
+             && ibucket->vallen + cmd->value_stored <= inline_vallen;
+    case PROTOCOL_BINARY_CMD_INCREMENT:
+    case PROTOCOL_BINARY_CMD_INCREMENTQ:
+    case PROTOCOL_BINARY_CMD_DECREMENT:
+    case PROTOCOL_BINARY_CMD_DECREMENTQ:
+      return ibucket->is_numeric_val;
+    case PROTOCOL_BINARY_CMD_TOUCH:
+    case PROTOCOL_BINARY_CMD_TOUCHQ:
+      return true;
+    default:
+      return false;
+    }
+}
+
+static bool
+lru_table_upsert(lru_t *lru, lru_table *table, cmd_handler *cmd,
+                 lru_val_t *lru_val, uint64_t hashed_key, bool *retry)
+{
+  size_t inline_keylen, inline_vallen, ibucket_size, bucket_size;
+  uint64_t capacity, probing_key, mask, up32key, idx, idx_next;
   uint32_t longest_probes;
   uint8_t *buckets, magic, new_magic;
   struct bucket *bucket;
   struct inner_bucket *ibucket;
-  void *keyptr;
+  struct lru_deferred *deferred;
   bool ret;
 
   inline_keylen = lru->inline_keylen;
   inline_vallen = lru->inline_vallen;
-  keylen = cmd->req.keylen;
-  bucket_size = sizeof(struct bucket) + inline_keylen + inline_vallen;
+  bucket_size = lru_bucket_size(inline_keylen, inline_vallen);
   ibucket_size = sizeof(struct inner_bucket) + inline_keylen + inline_vallen;
-  buckets = lru->buckets;
+  buckets = table->buckets;
 
-  capacity = lru_capacity_(lru->capacity_clz, lru->capacity_ms4b);
-  mask = (1ULL << (64 - lru->capacity_clz)) - 1;
-  hashed_key = cityhash64((uint8_t *)cmd->key, keylen);
+  capacity = lru_capacity_(table->capacity_clz, table->capacity_ms4b);
+  mask = (1ULL << (64 - table->capacity_clz)) - 1;
   up32key = hashed_key >> 32;
 
   probing_key = hashed_key;
-  idx = fast_mod_scale(probing_key, mask, lru->capacity_ms4b);
+  idx = fast_mod_scale(probing_key, mask, table->capacity_ms4b);
   probing_key += up32key;
-  idx_next = fast_mod_scale(probing_key, mask, lru->capacity_ms4b);
+  idx_next = fast_mod_scale(probing_key, mask, table->capacity_ms4b);
   for (int probe = 0; probe < PROBE_STATS_SIZE; probe++)
     {
       int i = 0;
@@ -376,11 +1654,18 @@ lru_upsert(lru_t *lru, cmd_handler *cmd, lru_val_t *lru_val)
           rcu_read_lock();
           bucket = (struct bucket *)&buckets[idx * bucket_size];
           magic = atomic_load_explicit(&bucket->magic, memory_order_acquire);
-          if (magic == 0x80 || magic == 0x82 || (magic & 0x3) == 0x3)
+          if (magic == 0x80 || magic == 0x81 || magic == 0x82
+              || magic == 0x83)
             {
               rcu_read_unlock();
               continue;
             }
+          if (magic == 0x06)
+            {
+              rcu_read_unlock();
+              *retry = true;
+              return false;
+            }
           // insert case
           if (magic == 0 || magic == 2)
             {
@@ -426,13 +1711,24 @@ lru_upsert(lru_t *lru, cmd_handler *cmd, lru_val_t *lru_val)
                       &bucket->magic, &magic, new_magic, memory_order_acq_rel,
                       memory_order_acquire))
                 continue;
-              lru_write_empty_bucket(lru, bucket, cmd, lru_val);
+              if (!lru_write_empty_bucket(lru, bucket, cmd, lru_val))
+                {
+                  // Out of memory for the key or value, the bucket is
+                  // still free
+                  atomic_store_explicit(&bucket->magic, magic,
+                                        memory_order_release);
+                  return false;
+                }
+              if (magic == 2)
+                atomic_fetch_sub_explicit(&lru->tombstones, 1,
+                                          memory_order_relaxed);
               bucket->ibucket.probe = probe;
+              lru_set_tag(table, idx, lru_tag(hashed_key));
               atomic_store_explicit(&bucket->magic, 1, memory_order_release);
               atomic_fetch_add_explicit(&lru->probe_stats[probe], 1,
                                         memory_order_relaxed);
 
-              longest_probes = atomic_load_explicit(&lru->longest_probes,
+              longest_probes = atomic_load_explicit(&table->longest_probes,
                                                     memory_order_acquire);
               do
                 {
@@ -440,19 +1736,18 @@ lru_upsert(lru_t *lru, cmd_handler *cmd, lru_val_t *lru_val)
                     break;
                 }
               while (!atomic_compare_exchange_strong_explicit(
-                  &lru->longest_probes, &longest_probes, probe,
+                  &table->longest_probes, &longest_probes, probe,
                   memory_order_release, memory_order_relaxed));
               return true;
             }
-          // This is where we read the value rcu read lock is protecting
-          if (bucket->ibucket.keylen != keylen)
+          if (magic == 0x42)
             {
               rcu_read_unlock();
               goto next_iter;
             }
-          keyptr = keylen > inline_keylen ? *(void **)&bucket->ibucket.data
-                                          : &bucket->ibucket.data;
-          if (!memeq(keyptr, cmd->key, keylen))
+          // This is where we read the value rcu read lock is protecting
+          ibucket = lru_ibucket(lru, bucket, magic, ibucket_size);
+          if (!lru_ibucket_keyeq(lru, ibucket, cmd))
             {
               rcu_read_unlock();
               goto next_iter;
@@ -466,22 +1761,73 @@ lru_upsert(lru_t *lru, cmd_handler *cmd, lru_val_t *lru_val)
               lru_val->rescode = PROTOCOL_BINARY_RESPONSE_NOT_STORED;
               return false;
             }
-          uint8_t tmp_idx;
+          // Small overwrites are done in place under seq, like a
+          // seqlock.
+          if (magic == 1 && lru_inplace_ok(lru, &bucket->ibucket, cmd))
+            {
+              void *garbage = NULL;
+              size_t garbage_len;
+              if (!atomic_compare_exchange_strong_explicit(
+                      &bucket->magic, &magic, 0x81, memory_order_acq_rel,
+                      memory_order_acquire))
+                continue;
+              if (!lru_inplace_ok(lru, &bucket->ibucket, cmd))
+                {
+                  atomic_store_explicit(&bucket->magic, 1,
+                                        memory_order_release);
+                  continue;
+                }
+              atomic_fetch_add_explicit(&bucket->seq, 1, memory_order_relaxed);
+              atomic_thread_fence(memory_order_release);
+              ret = lru_update_bucket(lru, bucket, &bucket->ibucket, cmd,
+                                      lru_val, &garbage, &garbage_len);
+              atomic_fetch_add_explicit(&bucket->seq, 1, memory_order_release);
+              atomic_store_explicit(&bucket->magic, 1, memory_order_release);
+              return ret;
+            }
+          // Lock the bucket, readers keep reading it meanwhile. The
+          // update is applied to a copy in a tmp bucket, which is then
+          // published to readers. The copy is committed back to the
+          // bucket after a grace period, so the writer never waits. If
+          // the previous update is not committed yet, the new copy is
+          // made from its tmp bucket and replaces it.
+          uint16_t tmp_idx;
+          void *garbage = NULL;
+          size_t garbage_len = 0;
           ibucket = alloc_tmpbucket(lru, &tmp_idx);
-          memcpy(ibucket, &bucket->ibucket, ibucket_size);
+          if (!ibucket)
+            {
+              lru_val->rescode = PROTOCOL_BINARY_RESPONSE_ENOMEM;
+              return false;
+            }
           if (!atomic_compare_exchange_strong_explicit(
-                  &bucket->magic, &magic, (tmp_idx << 2) | 0x3,
-                  memory_order_acq_rel, memory_order_acquire))
+                  &bucket->magic, &magic, magic | 0x80, memory_order_acq_rel,
+                  memory_order_acquire))
             {
               free_tmpbucket(lru, tmp_idx);
               continue;
             }
-          synchronize_rcu();
-          ret = lru_update_bucket(lru, bucket, cmd, lru_val);
-          atomic_store_explicit(&bucket->magic, 1, memory_order_release);
-          synchronize_rcu();
-          free_tmpbucket(lru, tmp_idx);
-          return ret;
+          memcpy(ibucket, lru_ibucket(lru, bucket, magic, ibucket_size),
+                 ibucket_size);
+          ret = lru_update_bucket(lru, bucket, ibucket, cmd, lru_val,
+                                  &garbage, &garbage_len);
+          if (!ret)
+            {
+              // Nothing was published, so nobody looked at the tmp bucket
+              atomic_store_explicit(&bucket->magic, magic,
+                                    memory_order_release);
+              free_tmpbucket(lru, tmp_idx);
+              return false;
+            }
+          atomic_store_explicit(&bucket->tmp_idx, tmp_idx,
+                                memory_order_release);
+          atomic_store_explicit(&bucket->magic, 0x03, memory_order_release);
+          deferred = lru_deferred_alloc(lru, bucket);
+          deferred->tmp_idx = tmp_idx;
+          deferred->valptr = garbage;
+          deferred->vallen = garbage_len;
+          call_rcu(&deferred->head, lru_commit_update_cb);
+          return true;
         next_iter:
           if (++i == 4)
             break;
@@ -490,25 +1836,60 @@ lru_upsert(lru_t *lru, cmd_handler *cmd, lru_val_t *lru_val)
             idx = 0;
           probe++;
         }
+      idx = idx_next;
+      probing_key += up32key;
+      idx_next = fast_mod_scale(probing_key, mask, table->capacity_ms4b);
     }
   lru_val->rescode = PROTOCOL_BINARY_RESPONSE_BUSY;
   return false;
 }
 
-void
+bool
+lru_upsert(lru_t *lru, cmd_handler *cmd, lru_val_t *lru_val)
+{
+  lru_table *table, *old_table;
+  uint64_t hashed_key;
+  bool retry, ret;
+
+  hashed_key = cityhash64((uint8_t *)cmd->key, cmd->req.keylen);
+  do
+    {
+      retry = false;
+      lru_tables(lru, &table, &old_table);
+      // Writers only write the new table, the item is moved over first.
+      if (old_table)
+        {
+          lru_migrate_key(lru, old_table, table, cmd, hashed_key);
+          lru_migrate_step(lru, old_table, table, LRU_MIGRATE_STEP);
+        }
+      ret = lru_table_upsert(lru, table, cmd, lru_val, hashed_key, &retry);
+    }
+  while (retry);
+  return ret;
+}
+
+// Write the item of cmd to a bucket locked by the caller. Returns false
+// with PROTOCOL_BINARY_RESPONSE_ENOMEM if no chunk is left for an out of
+// line key or value, nothing is accounted for then.
+bool
 lru_write_empty_bucket(lru_t *lru, struct bucket *bucket, cmd_handler *cmd,
                        lru_val_t *lru_val)
 {
   size_t inline_keylen, inline_vallen, keylen, vallen;
   uint64_t txid;
   time_t now;
+  void *keychunk = NULL, *valchunk = NULL;
 
   inline_keylen = lru->inline_keylen;
   inline_vallen = lru->inline_vallen;
 
-  time(&now);
-  txid = atomic_fetch_add_explicit(&lru->txid, 1, memory_order_relaxed);
+  now = clock_now();
   keylen = cmd->req.keylen;
+  if (keylen > inline_keylen && !(keychunk = slab_alloc(keylen)))
+    {
+      lru_val->rescode = PROTOCOL_BINARY_RESPONSE_ENOMEM;
+      return false;
+    }
 
   switch (cmd->req.op)
     {
@@ -516,25 +1897,33 @@ lru_write_empty_bucket(lru_t *lru, struct bucket *bucket, cmd_handler *cmd,
     case PROTOCOL_BINARY_CMD_SETQ:
     case PROTOCOL_BINARY_CMD_ADD:
     case PROTOCOL_BINARY_CMD_ADDQ:
+      vallen = cmd->value_stored;
+      if (vallen > inline_vallen && !(valchunk = lru_val_alloc(lru, vallen)))
+        {
+          slab_free(keychunk, keylen);
+          lru_val->rescode = PROTOCOL_BINARY_RESPONSE_ENOMEM;
+          return false;
+        }
+      txid = lru_next_txid(lru);
       bucket->txid = txid;
       bucket->ibucket.is_numeric_val = false;
       bucket->ibucket.flags = cmd->extra.twoval.flags;
-      bucket->ibucket.epoch = now + cmd->extra.twoval.expiration;
+      bucket->ibucket.epoch = lru_epoch(now, cmd->extra.twoval.expiration);
       bucket->ibucket.cas = txid;
 
-      vallen = cmd->value_stored;
       bucket->ibucket.keylen = keylen;
       bucket->ibucket.vallen = vallen;
 
       if (keylen > inline_keylen)
         {
           void **keyptr = (void **)&bucket->ibucket.data[0];
-          *keyptr = malloc(keylen);
+          *keyptr = keychunk;
           memcpy(*keyptr, cmd->key, keylen);
           atomic_fetch_add_explicit(&lru->ninline_keycnt, 1,
                                     memory_order_relaxed);
           atomic_fetch_add_explicit(&lru->ninline_keylen, keylen,
                                     memory_order_relaxed);
+          lru_out_add(lru, slab_chunk_size(keylen));
         }
       else
         {
@@ -546,12 +1935,13 @@ lru_write_empty_bucket(lru_t *lru, struct bucket *bucket, cmd_handler *cmd,
       if (vallen > inline_vallen)
         {
           void **valptr = (void **)&bucket->ibucket.data[inline_keylen];
-          *valptr = malloc(vallen);
+          *valptr = valchunk;
           memcpy(*valptr, cmd->value, vallen);
           atomic_fetch_add_explicit(&lru->ninline_valcnt, 1,
                                     memory_order_relaxed);
           atomic_fetch_add_explicit(&lru->ninline_vallen, vallen,
                                     memory_order_relaxed);
+          lru_out_add(lru, lru_val_size(vallen));
         }
       else
         {
@@ -562,25 +1952,27 @@ lru_write_empty_bucket(lru_t *lru, struct bucket *bucket, cmd_handler *cmd,
       atomic_fetch_add_explicit(&lru->objcnt, 1, memory_order_relaxed);
       lru_val->rescode = PROTOCOL_BINARY_RESPONSE_SUCCESS;
       lru_val->is_numeric_val = false;
-      return;
+      return true;
     case PROTOCOL_BINARY_CMD_INCREMENT:
     case PROTOCOL_BINARY_CMD_INCREMENTQ:
     case PROTOCOL_BINARY_CMD_DECREMENT:
     case PROTOCOL_BINARY_CMD_DECREMENTQ:
+      txid = lru_next_txid(lru);
       bucket->txid = txid;
       bucket->ibucket.is_numeric_val = true;
       bucket->ibucket.cas = txid;
-      bucket->ibucket.epoch = now + cmd->extra.twoval.expiration;
+      bucket->ibucket.epoch = lru_epoch(now, cmd->extra.twoval.expiration);
       bucket->ibucket.keylen = keylen;
       if (keylen > inline_keylen)
         {
           void **keyptr = (void **)&bucket->ibucket.data[0];
-          *keyptr = malloc(keylen);
+          *keyptr = keychunk;
           memcpy(*keyptr, cmd->key, keylen);
           atomic_fetch_add_explicit(&lru->ninline_keycnt, 1,
                                     memory_order_relaxed);
           atomic_fetch_add_explicit(&lru->ninline_keylen, keylen,
                                     memory_order_relaxed);
+          lru_out_add(lru, slab_chunk_size(keylen));
         }
       else
         {
@@ -600,23 +1992,30 @@ lru_write_empty_bucket(lru_t *lru, struct bucket *bucket, cmd_handler *cmd,
       lru_val->rescode = PROTOCOL_BINARY_RESPONSE_SUCCESS;
       lru_val->is_numeric_val = true;
       lru_val->vallen = bucket->ibucket.vallen;
-      return;
+      return true;
     default:
+      slab_free(keychunk, keylen);
       lru_val->rescode = PROTOCOL_BINARY_RESPONSE_INTERNAL_ERR;
+      return false;
     }
 }
 
+// Apply the update to ibucket, a private copy of the bucket. An out of
+// line value it replaces is not freed but handed back through garbage
+// and garbage_len, readers of the bucket may still be looking at it.
 bool
-lru_update_bucket(lru_t *lru, struct bucket *bucket, cmd_handler *cmd,
-                  lru_val_t *lru_val)
+lru_update_bucket(lru_t *lru, struct bucket *bucket,
+                  struct inner_bucket *ibucket, cmd_handler *cmd,
+                  lru_val_t *lru_val, void **garbage, size_t *garbage_len)
 {
   uint64_t txid;
   size_t inline_keylen, inline_vallen, vallen, current_vallen;
   time_t now;
   uint8_t *valiter;
   void *newval;
+  char numstr[21];
 
-  time(&now);
+  now = clock_now();
   inline_keylen = lru->inline_keylen;
   inline_vallen = lru->inline_vallen;
   vallen = cmd->value_stored;
@@ -627,52 +2026,62 @@ lru_update_bucket(lru_t *lru, struct bucket *bucket, cmd_handler *cmd,
     case PROTOCOL_BINARY_CMD_SETQ:
       // Set may be a cas request. Other than cas logic it is
       // same as replace logic.
-      if (cmd->req.cas > 0 && cmd->req.cas != bucket->ibucket.cas)
+      if (cmd->req.cas > 0 && cmd->req.cas != ibucket->cas)
         {
           lru_val->rescode = PROTOCOL_BINARY_RESPONSE_KEY_ENOENT;
           return false;
         }
     case PROTOCOL_BINARY_CMD_REPLACE:
     case PROTOCOL_BINARY_CMD_REPLACEQ:
-      txid = atomic_fetch_add_explicit(&lru->txid, 1, memory_order_relaxed);
+      // Allocate first, so that nothing is changed if it fails
+      newval = NULL;
+      if (vallen > inline_vallen && !(newval = lru_val_alloc(lru, vallen)))
+        {
+          lru_val->rescode = PROTOCOL_BINARY_RESPONSE_ENOMEM;
+          return false;
+        }
+      txid = lru_next_txid(lru);
       bucket->txid = txid;
-      bucket->ibucket.is_numeric_val = false;
-      bucket->ibucket.flags = cmd->extra.twoval.flags;
-      bucket->ibucket.epoch = now + cmd->extra.twoval.expiration;
-      bucket->ibucket.cas = txid;
-      if (!bucket->ibucket.is_numeric_val)
+      ibucket->is_numeric_val = false;
+      ibucket->flags = cmd->extra.twoval.flags;
+      ibucket->epoch = lru_epoch(now, cmd->extra.twoval.expiration);
+      ibucket->cas = txid;
+      if (!ibucket->is_numeric_val)
         {
-          if (bucket->ibucket.vallen > inline_vallen)
+          if (ibucket->vallen > inline_vallen)
             {
-              void **valptr = (void **)&bucket->ibucket.data[inline_keylen];
-              free(*valptr);
+              void **valptr = (void **)&ibucket->data[inline_keylen];
+              *garbage = *valptr;
+              *garbage_len = ibucket->vallen;
               atomic_fetch_sub_explicit(&lru->ninline_valcnt, 1,
                                         memory_order_relaxed);
               atomic_fetch_sub_explicit(&lru->ninline_vallen,
-                                        bucket->ibucket.vallen,
+                                        ibucket->vallen,
                                         memory_order_relaxed);
+              lru_out_sub(lru, lru_val_size(ibucket->vallen));
             }
           else
             {
               atomic_fetch_sub_explicit(&lru->inline_acc_vallen,
-                                        bucket->ibucket.vallen,
+                                        ibucket->vallen,
                                         memory_order_relaxed);
             }
         }
-      bucket->ibucket.vallen = vallen;
+      ibucket->vallen = vallen;
       if (vallen > inline_vallen)
         {
-          void **valptr = (void **)&bucket->ibucket.data[inline_keylen];
-          *valptr = malloc(vallen);
+          void **valptr = (void **)&ibucket->data[inline_keylen];
+          *valptr = newval;
           memcpy(*valptr, cmd->value, vallen);
           atomic_fetch_add_explicit(&lru->ninline_valcnt, 1,
                                     memory_order_relaxed);
           atomic_fetch_add_explicit(&lru->ninline_vallen, vallen,
                                     memory_order_relaxed);
+          lru_out_add(lru, lru_val_size(vallen));
         }
       else
         {
-          memcpy(&bucket->ibucket.data[inline_keylen], cmd->value, vallen);
+          memcpy(&ibucket->data[inline_keylen], cmd->value, vallen);
           atomic_fetch_add_explicit(&lru->inline_acc_vallen, vallen,
                                     memory_order_relaxed);
         }
@@ -682,61 +2091,71 @@ lru_update_bucket(lru_t *lru, struct bucket *bucket, cmd_handler *cmd,
     case PROTOCOL_BINARY_CMD_APPENDQ:
     case PROTOCOL_BINARY_CMD_PREPEND:
     case PROTOCOL_BINARY_CMD_PREPENDQ:
-      txid = atomic_fetch_add_explicit(&lru->txid, 1, memory_order_relaxed);
+      current_vallen = ibucket->is_numeric_val
+                           ? size_t_str_len(ibucket->vallen)
+                           : ibucket->vallen;
+      newval = NULL;
+      if (current_vallen + vallen > inline_vallen
+          && !(newval = lru_val_alloc(lru, current_vallen + vallen)))
+        {
+          lru_val->rescode = PROTOCOL_BINARY_RESPONSE_ENOMEM;
+          return false;
+        }
+      txid = lru_next_txid(lru);
       bucket->txid = txid;
-      bucket->ibucket.flags = cmd->extra.twoval.flags;
-      bucket->ibucket.epoch = now + cmd->extra.twoval.expiration;
-      bucket->ibucket.cas = txid;
+      ibucket->flags = cmd->extra.twoval.flags;
+      ibucket->epoch = lru_epoch(now, cmd->extra.twoval.expiration);
+      ibucket->cas = txid;
 
-      if (bucket->ibucket.is_numeric_val)
+      if (ibucket->is_numeric_val)
         {
-          current_vallen = size_t_str_len(bucket->ibucket.vallen);
-          bucket->ibucket.is_numeric_val = false;
+          ibucket->is_numeric_val = false;
 
           if (current_vallen + vallen > inline_vallen)
             {
-              void **valptr = (void **)&bucket->ibucket.data[inline_keylen];
-              *valptr = malloc(vallen + current_vallen);
+              void **valptr = (void **)&ibucket->data[inline_keylen];
+              *valptr = newval;
               valiter = *valptr;
               atomic_fetch_add_explicit(&lru->ninline_valcnt, 1,
                                         memory_order_relaxed);
               atomic_fetch_add_explicit(&lru->ninline_vallen,
                                         vallen + current_vallen,
                                         memory_order_relaxed);
+              lru_out_add(lru, lru_val_size(vallen + current_vallen));
             }
           else
             {
-              valiter = &bucket->ibucket.data[inline_keylen];
+              valiter = &ibucket->data[inline_keylen];
               atomic_fetch_add_explicit(&lru->inline_acc_vallen,
                                         current_vallen + vallen,
                                         memory_order_relaxed);
             }
+          // Chunks are packed, the number is copied without its NUL
+          snprintf(numstr, sizeof(numstr), "%zu", ibucket->vallen);
           if (cmd->req.op == PROTOCOL_BINARY_CMD_APPEND
               || cmd->req.op == PROTOCOL_BINARY_CMD_APPENDQ)
             {
-              valiter
-                  += sprintf((char *)valiter, "%zu", bucket->ibucket.vallen);
+              memcpy(valiter, numstr, current_vallen);
+              valiter += current_vallen;
               memcpy(valiter, cmd->value, vallen);
-              bucket->ibucket.vallen = current_vallen + vallen;
+              ibucket->vallen = current_vallen + vallen;
             }
           else
             { // prepend
               memcpy(valiter, cmd->value, vallen);
               valiter += vallen;
-              sprintf((char *)valiter, "%zu", bucket->ibucket.vallen);
-              bucket->ibucket.vallen = current_vallen + vallen;
+              memcpy(valiter, numstr, current_vallen);
+              ibucket->vallen = current_vallen + vallen;
             }
           lru_val->rescode = PROTOCOL_BINARY_RESPONSE_SUCCESS;
           return true;
         }
 
       // Non numerical value case
-      current_vallen = bucket->ibucket.vallen;
-
       if (current_vallen > inline_vallen)
         {
-          void **valptr = (void **)&bucket->ibucket.data[inline_keylen];
-          newval = valiter = malloc(vallen + current_vallen);
+          void **valptr = (void **)&ibucket->data[inline_keylen];
+          valiter = newval;
           if (cmd->req.op == PROTOCOL_BINARY_CMD_APPEND
               || cmd->req.op == PROTOCOL_BINARY_CMD_APPENDQ)
             {
@@ -750,21 +2169,24 @@ lru_update_bucket(lru_t *lru, struct bucket *bucket, cmd_handler *cmd,
               valiter += vallen;
               memcpy(valiter, *valptr, current_vallen);
             }
-          free(*valptr);
+          *garbage = *valptr;
+          *garbage_len = current_vallen;
           *valptr = newval;
           atomic_fetch_add_explicit(&lru->ninline_vallen, vallen,
                                     memory_order_relaxed);
-          bucket->ibucket.vallen = current_vallen + vallen;
+          lru_out_sub(lru, lru_val_size(current_vallen));
+          lru_out_add(lru, lru_val_size(current_vallen + vallen));
+          ibucket->vallen = current_vallen + vallen;
           return true;
         }
       else if (current_vallen + vallen > inline_vallen)
         {
-          void **valptr = (void **)&bucket->ibucket.data[inline_keylen];
-          newval = valiter = malloc(vallen + current_vallen);
+          void **valptr = (void **)&ibucket->data[inline_keylen];
+          valiter = newval;
           if (cmd->req.op == PROTOCOL_BINARY_CMD_APPEND
               || cmd->req.op == PROTOCOL_BINARY_CMD_APPENDQ)
             {
-              memcpy(valiter, &bucket->ibucket.data[inline_keylen],
+              memcpy(valiter, &ibucket->data[inline_keylen],
                      current_vallen);
               valiter += current_vallen;
               memcpy(valiter, cmd->value, vallen);
@@ -773,7 +2195,7 @@ lru_update_bucket(lru_t *lru, struct bucket *bucket, cmd_handler *cmd,
             {
               memcpy(valiter, cmd->value, vallen);
               valiter += vallen;
-              memcpy(valiter, &bucket->ibucket.data[inline_keylen],
+              memcpy(valiter, &ibucket->data[inline_keylen],
                      current_vallen);
             }
           *valptr = newval;
@@ -784,7 +2206,8 @@ lru_update_bucket(lru_t *lru, struct bucket *bucket, cmd_handler *cmd,
           atomic_fetch_add_explicit(&lru->ninline_vallen,
                                     vallen + current_vallen,
                                     memory_order_relaxed);
-          bucket->ibucket.vallen = current_vallen + vallen;
+          lru_out_add(lru, lru_val_size(vallen + current_vallen));
+          ibucket->vallen = current_vallen + vallen;
           lru_val->rescode = PROTOCOL_BINARY_RESPONSE_SUCCESS;
           return true;
         }
@@ -793,21 +2216,21 @@ lru_update_bucket(lru_t *lru, struct bucket *bucket, cmd_handler *cmd,
           if (cmd->req.op == PROTOCOL_BINARY_CMD_APPEND
               || cmd->req.op == PROTOCOL_BINARY_CMD_APPENDQ)
             {
-              memcpy(&bucket->ibucket.data[inline_keylen + current_vallen],
+              memcpy(&ibucket->data[inline_keylen + current_vallen],
                      cmd->value, vallen);
             }
           else
             {
               void *tmp = alloca(current_vallen);
-              memcpy(tmp, &bucket->ibucket.data[inline_keylen],
+              memcpy(tmp, &ibucket->data[inline_keylen],
                      current_vallen);
-              memcpy(&bucket->ibucket.data[inline_keylen], cmd->value, vallen);
-              memcpy(&bucket->ibucket.data[inline_keylen + vallen], tmp,
+              memcpy(&ibucket->data[inline_keylen], cmd->value, vallen);
+              memcpy(&ibucket->data[inline_keylen + vallen], tmp,
                      current_vallen);
             }
           atomic_fetch_add_explicit(&lru->inline_acc_vallen, vallen,
                                     memory_order_relaxed);
-          bucket->ibucket.vallen = current_vallen + vallen;
+          ibucket->vallen = current_vallen + vallen;
           lru_val->rescode = PROTOCOL_BINARY_RESPONSE_SUCCESS;
           return true;
         }
@@ -815,70 +2238,72 @@ lru_update_bucket(lru_t *lru, struct bucket *bucket, cmd_handler *cmd,
     case PROTOCOL_BINARY_CMD_INCREMENTQ:
     case PROTOCOL_BINARY_CMD_DECREMENT:
     case PROTOCOL_BINARY_CMD_DECREMENTQ:
-      if (!bucket->ibucket.is_numeric_val)
+      if (!ibucket->is_numeric_val)
         {
           ed_errno = 0;
           // BUG: valptr may not be inline
           uint64_t numeric_val;
           void *valptr;
-          valptr = bucket->ibucket.vallen > inline_vallen
-                       ? *((void **)&bucket->ibucket.data[inline_keylen])
-                       : &bucket->ibucket.data[inline_keylen];
+          valptr = ibucket->vallen > inline_vallen
+                       ? *((void **)&ibucket->data[inline_keylen])
+                       : &ibucket->data[inline_keylen];
 
           numeric_val
-              = strn2uint64(valptr, bucket->ibucket.vallen, (char **)&valiter);
+              = strn2uint64(valptr, ibucket->vallen, (char **)&valiter);
           if (ed_errno
-              || (valiter - (uint8_t *)valptr) != bucket->ibucket.vallen)
+              || (valiter - (uint8_t *)valptr) != ibucket->vallen)
             {
               syslog(LOG_ERR,
                      "cannot increment or decrement non-numeric value");
               lru_val->rescode = PROTOCOL_BINARY_RESPONSE_DELTA_BADVAL;
               return false;
             }
-          if (bucket->ibucket.vallen > inline_vallen)
+          if (ibucket->vallen > inline_vallen)
             {
-              free(valptr);
+              *garbage = valptr;
+              *garbage_len = ibucket->vallen;
               atomic_fetch_sub_explicit(&lru->ninline_valcnt, 1,
                                         memory_order_relaxed);
               atomic_fetch_sub_explicit(&lru->ninline_vallen,
-                                        bucket->ibucket.vallen,
+                                        ibucket->vallen,
                                         memory_order_relaxed);
+              lru_out_sub(lru, lru_val_size(ibucket->vallen));
             }
           else
             {
               atomic_fetch_sub_explicit(&lru->inline_acc_vallen,
-                                        bucket->ibucket.vallen,
+                                        ibucket->vallen,
                                         memory_order_relaxed);
             }
-          bucket->ibucket.is_numeric_val = true;
-          bucket->ibucket.vallen = numeric_val;
+          ibucket->is_numeric_val = true;
+          ibucket->vallen = numeric_val;
         }
-      txid = atomic_fetch_add_explicit(&lru->txid, 1, memory_order_relaxed);
+      txid = lru_next_txid(lru);
       bucket->txid = txid;
-      bucket->ibucket.cas = txid;
+      ibucket->cas = txid;
       if (cmd->req.op == PROTOCOL_BINARY_CMD_INCREMENT
           || cmd->req.op == PROTOCOL_BINARY_CMD_INCREMENTQ)
-        bucket->ibucket.vallen += cmd->extra.numeric.addition_value;
-      else if (cmd->extra.numeric.addition_value > bucket->ibucket.vallen)
-        bucket->ibucket.vallen = 0;
+        ibucket->vallen += cmd->extra.numeric.addition_value;
+      else if (cmd->extra.numeric.addition_value > ibucket->vallen)
+        ibucket->vallen = 0;
       else
-        bucket->ibucket.vallen -= cmd->extra.numeric.addition_value;
+        ibucket->vallen -= cmd->extra.numeric.addition_value;
       // Numeric expiration is only exposed to the binary API.
       // We use UINT64_MAX to mark if a numeric command is parsed from
       // ascii protocol or from binary protocol (UINT64_MAX => ascii).
       // When it is binary, we add the expiration, otherwise it inherits
       // the expiration.
       if (cmd->extra.numeric.init_value != UINT64_MAX)
-        bucket->ibucket.epoch = now + cmd->extra.numeric.expiration;
+        ibucket->epoch = lru_epoch(now, cmd->extra.numeric.expiration);
       lru_val->rescode = PROTOCOL_BINARY_RESPONSE_SUCCESS;
       lru_val->is_numeric_val = true;
-      lru_val->vallen = bucket->ibucket.vallen;
+      lru_val->vallen = ibucket->vallen;
       return true;
     case PROTOCOL_BINARY_CMD_TOUCH:
     case PROTOCOL_BINARY_CMD_TOUCHQ:
       txid = atomic_load_explicit(&lru->txid, memory_order_relaxed);
       bucket->txid = txid;
-      bucket->ibucket.epoch = now + cmd->extra.twoval.expiration;
+      ibucket->epoch = lru_epoch(now, cmd->extra.twoval.expiration);
       lru_val->rescode = PROTOCOL_BINARY_RESPONSE_SUCCESS;
       return true;
     default:
@@ -889,43 +2314,47 @@ lru_update_bucket(lru_t *lru, struct bucket *bucket, cmd_handler *cmd,
   return false;
 }
 
-void
-lru_delete(lru_t *lru, cmd_handler *cmd)
+static void
+lru_table_delete(lru_t *lru, lru_table *table, cmd_handler *cmd,
+                 uint64_t hashed_key, bool *retry)
 {
-  size_t inline_keylen, inline_vallen, keylen, vallen, ibucket_size,
-      bucket_size;
-  uint64_t capacity, hashed_key, probing_key, mask, up32key, idx, idx_next;
+  size_t inline_keylen, inline_vallen, ibucket_size, bucket_size;
+  uint64_t capacity, probing_key, mask, up32key, idx, idx_next, slot;
   uint32_t longest_probes;
-  uint8_t *buckets, magic;
+  unsigned int candidates;
+  uint8_t *buckets, magic, tag;
   struct bucket *bucket;
-  void *keyptr;
+  struct inner_bucket *ibucket;
 
   inline_keylen = lru->inline_keylen;
   inline_vallen = lru->inline_vallen;
-  keylen = cmd->req.keylen;
-  bucket_size = sizeof(struct bucket) + inline_keylen + inline_vallen;
+  bucket_size = lru_bucket_size(inline_keylen, inline_vallen);
   ibucket_size = sizeof(struct inner_bucket) + inline_keylen + inline_vallen;
   longest_probes
-      = atomic_load_explicit(&lru->longest_probes, memory_order_acquire);
-  buckets = lru->buckets;
+      = atomic_load_explicit(&table->longest_probes, memory_order_acquire);
+  buckets = table->buckets;
 
-  capacity = lru_capacity_(lru->capacity_clz, lru->capacity_ms4b);
-  mask = (1ULL << (64 - lru->capacity_clz)) - 1;
-  hashed_key = cityhash64((uint8_t *)cmd->key, keylen);
+  capacity = lru_capacity_(table->capacity_clz, table->capacity_ms4b);
+  mask = (1ULL << (64 - table->capacity_clz)) - 1;
   up32key = hashed_key >> 32;
+  tag = lru_tag(hashed_key);
 
   probing_key = hashed_key;
-  idx = fast_mod_scale(probing_key, mask, lru->capacity_ms4b);
+  idx = fast_mod_scale(probing_key, mask, table->capacity_ms4b);
   probing_key += up32key;
-  idx_next = fast_mod_scale(probing_key, mask, lru->capacity_ms4b);
-  for (int probe = 0; probe <= longest_probes; probe++)
+  idx_next = fast_mod_scale(probing_key, mask, table->capacity_ms4b);
+  for (int probe = 0; probe <= longest_probes; probe += 4)
     {
-      int i = 0;
-      __builtin_prefetch(&buckets[idx_next * bucket_size], 0, 0);
-      while (true)
+      __builtin_prefetch(&table->tags[idx_next], 0, 0);
+      candidates = lru_tag_candidates(table, idx, capacity, tag);
+      for (; candidates; candidates &= candidates - 1)
         {
+          slot = idx + __builtin_ctz(candidates);
+          if (slot >= capacity)
+            slot -= capacity;
+          bucket = (struct bucket *)&buckets[slot * bucket_size];
+        reload:
           rcu_read_lock();
-          bucket = (struct bucket *)&buckets[idx * bucket_size];
           magic = atomic_load_explicit(&bucket->magic, memory_order_acquire);
 
           if (magic == 0)
@@ -933,27 +2362,28 @@ lru_delete(lru_t *lru, cmd_handler *cmd)
               rcu_read_unlock();
               return;
             }
-          if (magic == 2)
+          if (magic == 2 || magic == 0x42)
             {
               rcu_read_unlock();
-              goto next_iter;
+              continue;
             }
-          if (magic == 0x80 || magic == 0x82 || (magic & 0x3) == 0x3)
+          if (magic == 0x06)
             {
               rcu_read_unlock();
-              continue;
+              *retry = true;
+              return;
             }
-          if (bucket->ibucket.keylen != keylen)
+          if (magic == 0x80 || magic == 0x81 || magic == 0x82
+              || magic == 0x83)
             {
               rcu_read_unlock();
-              goto next_iter;
+              goto reload;
             }
-          keyptr = keylen > inline_keylen ? *(void **)&bucket->ibucket.data
-                                          : &bucket->ibucket.data;
-          if (!memeq(keyptr, cmd->key, keylen))
+          ibucket = lru_ibucket(lru, bucket, magic, ibucket_size);
+          if (!lru_ibucket_keyeq(lru, ibucket, cmd))
             {
               rcu_read_unlock();
-              goto next_iter;
+              continue;
             }
           // finished reading the key, so now we can release the rcu read
           // lock.
@@ -962,282 +2392,414 @@ lru_delete(lru_t *lru, cmd_handler *cmd)
           // From readers view, this is as if the value is deleted in
           // an atomic operation.
           if (!atomic_compare_exchange_strong_explicit(
-                  &bucket->magic, &magic, 0x82, memory_order_release,
+                  &bucket->magic, &magic, 0x82, memory_order_acq_rel,
                   memory_order_acquire))
-            continue;
-          // Drain remaining readers that might be accessing it.
-          synchronize_rcu();
-          keylen = bucket->ibucket.keylen;
-          vallen = bucket->ibucket.vallen;
-          probe = bucket->ibucket.probe;
-          atomic_fetch_sub_explicit(&lru->probe_stats[probe], 1,
-                                    memory_order_relaxed);
-          if (keylen > inline_keylen)
-            {
-              atomic_fetch_sub_explicit(&lru->ninline_keycnt, 1,
-                                        memory_order_relaxed);
-              atomic_fetch_sub_explicit(&lru->ninline_keylen, keylen,
-                                        memory_order_relaxed);
-              free(*((void **)&bucket->ibucket.data[0]));
-            }
-          else
-            {
-              atomic_fetch_sub_explicit(&lru->inline_acc_keylen, keylen,
-                                        memory_order_relaxed);
-            }
-          if (!bucket->ibucket.is_numeric_val)
-            {
-              if (vallen > inline_vallen)
-                {
-                  atomic_fetch_sub_explicit(&lru->ninline_valcnt, 1,
-                                            memory_order_relaxed);
-                  atomic_fetch_sub_explicit(&lru->ninline_vallen, vallen,
-                                            memory_order_relaxed);
-                  free(*(void **)&bucket->ibucket.data[inline_keylen]);
-                }
-              else
-                {
-                  atomic_fetch_sub_explicit(&lru->inline_acc_vallen, vallen,
-                                            memory_order_relaxed);
-                }
-            }
-
-          atomic_fetch_sub_explicit(&lru->objcnt, 1, memory_order_relaxed);
-          atomic_store_explicit(&bucket->magic, 2, memory_order_release);
+            goto reload;
+          // A pending update still owns its tmp bucket and releases it
+          // on its own, the item is retired from its current version.
+          lru_retire_bucket(lru, bucket,
+                            lru_ibucket(lru, bucket, magic, ibucket_size));
           return;
-        next_iter:
-          if (++i == 4)
-            break;
-          idx++;
-          if (idx >= capacity)
-            idx = 0;
-          probe++;
         }
       idx = idx_next;
       probing_key += up32key;
-      idx_next = fast_mod_scale(probing_key, mask, lru->capacity_ms4b);
+      idx_next = fast_mod_scale(probing_key, mask, table->capacity_ms4b);
+    }
+}
+
+void
+lru_delete(lru_t *lru, cmd_handler *cmd)
+{
+  lru_table *table, *old_table;
+  uint64_t hashed_key;
+  bool retry;
+
+  hashed_key = cityhash64((uint8_t *)cmd->key, cmd->req.keylen);
+  do
+    {
+      retry = false;
+      lru_tables(lru, &table, &old_table);
+      if (old_table)
+        lru_migrate_key(lru, old_table, table, cmd, hashed_key);
+      lru_table_delete(lru, table, cmd, hashed_key, &retry);
     }
+  while (retry);
 }
 
 bool
 lru_delete_bucket(lru_t *lru, struct bucket *bucket, uint64_t txid)
 {
-  size_t inline_keylen, inline_vallen, keylen, vallen;
-  uint16_t probe;
   uint8_t magic;
 
-  inline_keylen = lru->inline_keylen;
-  inline_vallen = lru->inline_vallen;
-
-reload_magic:
   magic = atomic_load_explicit(&bucket->magic, memory_order_acquire);
   do
     {
       // If the bucket was touched by other thread, do not delete the
-      // bucket.
+      // bucket. Neither do we wait for a bucket another writer holds,
+      // it was just touched as well.
       if (bucket->txid > txid)
         return false;
-      if (magic == 0 || magic == 2)
+      if (magic != 1)
         return false;
-      if (magic == 0x80 || magic == 0x82 || (magic & 0x3) == 0x3)
-        goto reload_magic;
     }
   while (!atomic_compare_exchange_strong_explicit(&bucket->magic, &magic, 0x82,
                                                   memory_order_acq_rel,
                                                   memory_order_acquire));
 
-  // drain readers accessing this bucket
-  synchronize_rcu();
-  keylen = bucket->ibucket.keylen;
-  vallen = bucket->ibucket.vallen;
-  probe = bucket->ibucket.probe;
-  atomic_fetch_sub_explicit(&lru->probe_stats[probe], 1, memory_order_relaxed);
-  if (keylen > inline_keylen)
-    {
-      atomic_fetch_sub_explicit(&lru->ninline_keycnt, 1, memory_order_relaxed);
-      atomic_fetch_sub_explicit(&lru->ninline_keylen, keylen,
-                                memory_order_relaxed);
-      free(*((void **)&bucket->ibucket.data[0]));
-    }
-  else
-    {
-      atomic_fetch_sub_explicit(&lru->inline_acc_keylen, keylen,
-                                memory_order_relaxed);
-    }
-  if (!bucket->ibucket.is_numeric_val)
-    {
-      if (vallen > inline_vallen)
-        {
-          atomic_fetch_sub_explicit(&lru->ninline_valcnt, 1,
-                                    memory_order_relaxed);
-          atomic_fetch_sub_explicit(&lru->ninline_vallen, vallen,
-                                    memory_order_relaxed);
-          free(*(void **)&bucket->ibucket.data[inline_keylen]);
-        }
-      else
-        {
-          atomic_fetch_sub_explicit(&lru->inline_acc_vallen, vallen,
-                                    memory_order_relaxed);
-        }
-    }
-
-  atomic_fetch_sub_explicit(&lru->objcnt, 1, memory_order_relaxed);
-  atomic_store_explicit(&bucket->magic, 2, memory_order_release);
+  lru_retire_bucket(lru, bucket, &bucket->ibucket);
   return true;
 }
 
-void pq_swap(uint64_t (*a)[2], uint64_t (*b)[2])
+// Memory usage lru_swipe evicts down to, UINT64_MAX when the usage is
+// within the limit.
+static uint64_t
+lru_mem_target(lru_t *lru)
 {
-  uint64_t tmp;
-  tmp = (*a)[0];
-  (*a)[0] = (*b)[0];
-  (*b)[0] = tmp;
-  tmp = (*a)[1];
-  (*a)[1] = (*b)[1];
-  (*b)[1] = tmp;
+  if (lru->mem_limit && lru_mem_used(lru) > lru->mem_limit)
+    return LRU_MEM_LOW_WATER(lru->mem_limit);
+  return UINT64_MAX;
 }
 
-void
-pq_add(swiper_t *swiper, uint64_t idx, uint64_t txid)
+// Budget of a swipe step. Time is checked every 256 buckets.
+struct swipe_budget
 {
-  uint64_t pq_idx, pq_idx_parent;
+  uint64_t buckets;
+  bool timed;
+  struct timespec deadline;
+};
 
-  pq_idx = swiper->pqueue_used++;
-  swiper->pqueue[pq_idx][0] = idx;
-  swiper->pqueue[pq_idx][1] = txid;
-  while (pq_idx > 0)
-    {
-      pq_idx_parent = (pq_idx - 1) / 2;
-      if (swiper->pqueue[pq_idx_parent][1] < swiper->pqueue[pq_idx][1])
-        {
-          pq_swap(&swiper->pqueue[pq_idx_parent], &swiper->pqueue[pq_idx]);
-          pq_idx = pq_idx_parent;
-        }
-      else
-        break;
-    }
+static bool
+swipe_budget_spent(struct swipe_budget *budget, uint64_t nbuckets)
+{
+  struct timespec ts;
+
+  if (budget->buckets && nbuckets >= budget->buckets)
+    return true;
+  if (!budget->timed || (nbuckets & 255) != 255)
+    return false;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec > budget->deadline.tv_sec
+         || (ts.tv_sec == budget->deadline.tv_sec
+             && ts.tv_nsec >= budget->deadline.tv_nsec);
 }
 
-void
-pq_pop_add(swiper_t *swiper, uint64_t idx, uint64_t txid)
+// Index in swiper_t.hist of an age in txids: exact below
+// 1 << LRU_HIST_SUB_BITS, then 1 << LRU_HIST_SUB_BITS buckets per power
+// of two, so the ages of a bucket differ by less than 1/16.
+static inline int
+lru_hist_idx(uint64_t age)
 {
-  uint64_t pq_idx, pq_idx_l, pq_idx_r, max_idx;
-  pq_idx = 0;
-  if (txid >= swiper->pqueue[pq_idx][1])
-    return;
-  swiper->pqueue[pq_idx][0] = idx;
-  swiper->pqueue[pq_idx][1] = txid;
-  while (pq_idx < swiper->pqueue_size)
+  int exp;
+
+  if (age < (1 << LRU_HIST_SUB_BITS))
+    return age;
+  exp = 63 - __builtin_clzll(age);
+  return ((exp - LRU_HIST_SUB_BITS + 1) << LRU_HIST_SUB_BITS)
+         + ((age >> (exp - LRU_HIST_SUB_BITS))
+            & ((1 << LRU_HIST_SUB_BITS) - 1));
+}
+
+static inline uint64_t
+lru_hist_lower(int idx)
+{
+  if (idx < (1 << LRU_HIST_SUB_BITS))
+    return idx;
+  return ((uint64_t)(1 << LRU_HIST_SUB_BITS)
+          + (idx & ((1 << LRU_HIST_SUB_BITS) - 1)))
+         << ((idx >> LRU_HIST_SUB_BITS) - 1);
+}
+
+static inline uint64_t
+lru_hist_width(int idx)
+{
+  if (idx < (1 << LRU_HIST_SUB_BITS))
+    return 1;
+  return 1ULL << ((idx >> LRU_HIST_SUB_BITS) - 1);
+}
+
+// Txid the oldest num_to_del items counted in hist are at or below, 0 if
+// there is nothing to delete. The ages within the bucket the count runs
+// out in are taken as evenly spread. num_to_del is clamped to the items
+// counted.
+static uint64_t
+lru_hist_cutoff(const uint64_t *hist, uint64_t clock, uint64_t num_to_del)
+{
+  uint64_t acc, need, width, age, total;
+
+  total = 0;
+  for (int idx = 0; idx < LRU_HIST_SIZE; idx++)
+    total += hist[idx];
+  if (num_to_del > total)
+    num_to_del = total;
+  if (!num_to_del)
+    return 0;
+  acc = 0;
+  for (int idx = LRU_HIST_SIZE - 1; idx >= 0; idx--)
     {
-      pq_idx_l = pq_idx * 2 + 1;
-      pq_idx_r = pq_idx * 2 + 2;
-      max_idx = pq_idx;
-      if (pq_idx_l < swiper->pqueue_size
-          && swiper->pqueue[pq_idx_l][1] > swiper->pqueue[max_idx][1])
-        max_idx = pq_idx_l;
-      if (pq_idx_r < swiper->pqueue_size
-          && swiper->pqueue[pq_idx_r][1] > swiper->pqueue[max_idx][1])
-        max_idx = pq_idx_r;
-      if (max_idx != pq_idx)
+      if (acc + hist[idx] < num_to_del)
         {
-          pq_swap(&swiper->pqueue[pq_idx], &swiper->pqueue[max_idx]);
-          pq_idx = max_idx;
+          acc += hist[idx];
+          continue;
         }
-      else
-        break;
+      need = num_to_del - acc;
+      width = lru_hist_width(idx);
+      age = lru_hist_lower(idx) + width
+            - ((unsigned __int128)width * need + hist[idx] - 1) / hist[idx];
+      return age < clock ? clock - age : 0;
     }
+  return 0;
 }
 
-int
-pq_cmp(const void *_a, const void *_b)
+// Out of line bytes above the low water mark of mem_limit, which is all
+// evicting can free. The bucket tables count towards the limit as well
+// but stay whatever is evicted.
+static uint64_t
+lru_mem_excess(lru_t *lru)
 {
-  const int64_t(*a)[2] = _a;
-  const int64_t(*b)[2] = _b;
-  return (*a)[1] - (*b)[1];
+  uint64_t out_bytes, table_bytes, room;
+
+  if (!lru->mem_limit)
+    return 0;
+  out_bytes = atomic_load_explicit(&lru->out_bytes, memory_order_relaxed);
+  table_bytes = lru_mem_used(lru) - out_bytes;
+  room = LRU_MEM_LOW_WATER(lru->mem_limit);
+  room = room > table_bytes ? room - table_bytes : 0;
+  return out_bytes > room ? out_bytes - room : 0;
 }
 
-void
-pq_sort(swiper_t *swiper)
+// Items to evict for the object count threshold and, above the memory
+// limit, the items of average out of line size it takes to free the
+// bytes above the low water mark. Inline items free nothing and make the
+// average small, so one pass evicts at most as many items as hold out of
+// line bytes. Later swipes go on while the memory stays above the limit.
+static uint64_t
+lru_swipe_num_to_del(lru_t *lru, lru_table *table)
 {
-  qsort(swiper->pqueue, swiper->pqueue_used, sizeof(uint64_t[2]), pq_cmp);
+  uint64_t objcnt, threshold, num_to_del, excess, out_bytes, item_bytes,
+      num_mem, out_items;
+
+  objcnt = atomic_load_explicit(&lru->objcnt, memory_order_relaxed);
+  threshold = LRU_SWIPE_THRESHOLD(lru_table_capacity(table));
+  num_to_del = objcnt > threshold ? objcnt - threshold : 0;
+  if (lru_mem_target(lru) == UINT64_MAX || !objcnt)
+    return num_to_del;
+  excess = lru_mem_excess(lru);
+  if (!excess)
+    return num_to_del;
+
+  out_bytes = atomic_load_explicit(&lru->out_bytes, memory_order_relaxed);
+  item_bytes = out_bytes / objcnt;
+  if (!item_bytes)
+    item_bytes = 1;
+  num_mem = (excess + item_bytes - 1) / item_bytes;
+  out_items
+      = atomic_load_explicit(&lru->ninline_keycnt, memory_order_relaxed)
+        + atomic_load_explicit(&lru->ninline_valcnt, memory_order_relaxed);
+  if (num_mem > out_items)
+    num_mem = out_items;
+  if (num_mem > objcnt)
+    num_mem = objcnt;
+  return num_mem > num_to_del ? num_mem : num_to_del;
 }
 
-// This method can only be executed by a single thread.
-void
-lru_swipe(swiper_t *swiper)
+// O(N) in two passes over the part of the table. The first deletes the
+// expired items and counts the others in swiper->hist by the age of
+// their txid, from which swiper->cutoff, the txid the oldest items to
+// evict are at or below, is taken. The second evicts the items still at
+// or below the cutoff. The passes resume at swiper->cursor. Unless evict
+// is set the cutoff is left to lru_swipe_merge.
+static bool
+lru_swipe_scan(swiper_t *swiper, lru_table *table, time_t now,
+               struct swipe_budget *budget, bool evict)
 {
   lru_t *lru;
-  size_t inline_keylen, inline_vallen, ibucket_size, bucket_size;
-  uint64_t idx, capacity, txid, pq_idx, threshold, num_to_del, num_deleted,
-      objcnt;
-  unsigned int longest_probes, new_lp;
-  time_t now, epoch;
+  size_t bucket_size;
+  uint64_t idx, capacity, txid, nbuckets, start, end, threshold;
+  time_t epoch;
   uint8_t *buckets;
   struct bucket *bucket;
   uint8_t magic;
 
   lru = swiper->lru;
-  capacity = lru_capacity_(lru->capacity_clz, lru->capacity_ms4b);
-  threshold = capacity * 7 / 10;
-  inline_keylen = lru->inline_keylen;
-  inline_vallen = lru->inline_vallen;
-  bucket_size = sizeof(struct bucket) + inline_keylen + inline_vallen;
-  ibucket_size = sizeof(struct inner_bucket) + inline_keylen + inline_vallen;
-  time(&now);
-  buckets = lru->buckets;
-
-  // O(N * log(k)). k = priority queue size
-  // Scan through the lru table and delete items with outdated epoch.
-  // Enqueue idx and txid into the priority queue. When the priority
-  // queue is full, pop the max item in the queue so that we get a
-  // set of indexes which has the smallest txids.
-  for (idx = 0; idx < capacity; idx++)
+  capacity = lru_table_capacity(table);
+  bucket_size = lru_bucket_size(lru->inline_keylen, lru->inline_vallen);
+  buckets = table->buckets;
+  start = capacity * swiper->part / swiper->nparts;
+  end = capacity * (swiper->part + 1) / swiper->nparts;
+  nbuckets = 0;
+
+  if (!swiper->evicting)
     {
-      rcu_read_lock();
-      bucket = (struct bucket *)&buckets[idx * bucket_size];
-      magic = atomic_load_explicit(&bucket->magic, memory_order_acquire);
-      // we only delete old enough items
-      // items in update state, insert state, empty state or detele state
-      // can all be ignored.
-      if (magic != 1)
-        continue;
-      epoch = bucket->ibucket.epoch;
-      txid = bucket->txid;
-      rcu_read_unlock();
-
-      if (epoch < now)
+      for (idx = swiper->cursor; idx < end; idx++, nbuckets++)
         {
-          lru_delete_bucket(lru, bucket, UINT64_MAX);
+          if (swipe_budget_spent(budget, nbuckets))
+            break;
+          rcu_read_lock();
+          bucket = (struct bucket *)&buckets[idx * bucket_size];
+          magic = atomic_load_explicit(&bucket->magic, memory_order_acquire);
+          // we only delete old enough items
+          // items in update state, insert state, empty state or detele
+          // state can all be ignored.
+          if (magic != 1)
+            {
+              rcu_read_unlock();
+              continue;
+            }
+          epoch = bucket->ibucket.epoch;
+          txid = bucket->txid;
+          rcu_read_unlock();
+
+          if (epoch && epoch < now)
+            {
+              if (lru_delete_bucket(lru, bucket, UINT64_MAX))
+                swiper->expired++;
+            }
+          else
+            swiper->hist[lru_hist_idx(
+                txid < swiper->clock ? swiper->clock - txid : 0)]++;
         }
-      else
+      swiper->cursor = idx;
+      if (idx < end)
+        return false;
+      if (!evict)
+        return true;
+
+      swiper->cutoff = lru_hist_cutoff(swiper->hist, swiper->clock,
+                                       lru_swipe_num_to_del(lru, table));
+      if (!swiper->cutoff)
+        return true;
+      swiper->evicting = true;
+      swiper->cursor = start;
+    }
+
+  // Items touched since the first pass are newer than the cutoff and
+  // stay. The count behind the cutoff is an estimate, the pass stops
+  // early once the table is back under the threshold and the low water
+  // mark.
+  threshold = LRU_SWIPE_THRESHOLD(capacity);
+  for (idx = swiper->cursor; idx < end; idx++, nbuckets++)
+    {
+      if (swipe_budget_spent(budget, nbuckets))
+        break;
+      bucket = (struct bucket *)&buckets[idx * bucket_size];
+      if (atomic_load_explicit(&bucket->magic, memory_order_acquire) != 1)
+        continue;
+      if (atomic_load_explicit(&lru->objcnt, memory_order_relaxed)
+              <= threshold
+          && !lru_mem_excess(lru))
         {
-          if (swiper->pqueue_used <= swiper->pqueue_size)
-            pq_add(swiper, idx, txid);
-          else
-            pq_pop_add(swiper, idx, txid);
+          idx = end;
+          break;
         }
+      if (lru_delete_bucket(lru, bucket, swiper->cutoff))
+        swiper->evicted++;
     }
+  swiper->cursor = idx;
+  return idx == end;
+}
 
-  objcnt = atomic_load_explicit(&lru->objcnt, memory_order_relaxed);
-  if (objcnt > threshold)
+static inline uint64_t
+swiper_rand(swiper_t *swiper)
+{
+  uint64_t x = swiper->rand_state;
+
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  return swiper->rand_state = x;
+}
+
+// Sample LRU_EVICT_SAMPLES random buckets at a time, delete the expired
+// ones and, while over the object count threshold or the memory limit,
+// evict the least recently updated of the rest. Sampling goes on while
+// more than a quarter of a round was expired, like an active expiry
+// cycle. Rounds that evict nothing do at most as much work as a full
+// scan, they are counted in swiper->cursor.
+static bool
+lru_swipe_sample(swiper_t *swiper, lru_table *table, time_t now,
+                 struct swipe_budget *budget)
+{
+  lru_t *lru;
+  size_t bucket_size;
+  uint64_t idx, capacity, threshold, mem_target, max_rounds, txid,
+      oldest_txid, objcnt, nbuckets;
+  int round_expired;
+  bool pressure;
+  uint8_t *buckets;
+  struct bucket *bucket, *oldest;
+  time_t epoch;
+  uint8_t magic;
+
+  lru = swiper->lru;
+  capacity = lru_table_capacity(table);
+  threshold = LRU_SWIPE_THRESHOLD(capacity);
+  bucket_size = lru_bucket_size(lru->inline_keylen, lru->inline_vallen);
+  buckets = table->buckets;
+  mem_target = lru_mem_target(lru);
+  max_rounds = capacity / LRU_EVICT_SAMPLES + 1;
+
+  for (nbuckets = 0; swiper->cursor < max_rounds;
+       nbuckets += LRU_EVICT_SAMPLES)
     {
-      num_to_del = objcnt - threshold;
-      pq_sort(swiper);
-      for (num_deleted = 0, pq_idx = 0;
-           num_deleted < num_to_del && pq_idx < swiper->pqueue_size; pq_idx++)
+      if (swipe_budget_spent(budget, nbuckets))
+        return false;
+      oldest = NULL;
+      oldest_txid = UINT64_MAX;
+      round_expired = 0;
+      for (int i = 0; i < LRU_EVICT_SAMPLES; i++)
         {
-          bucket = (struct bucket
-                        *)&buckets[swiper->pqueue[pq_idx][0] * bucket_size];
-          if (lru_delete_bucket(lru, bucket, swiper->pqueue[pq_idx][1]))
-            num_deleted++;
+          // maps the random number to [0, capacity) without a division
+          idx = (unsigned __int128)swiper_rand(swiper) * capacity >> 64;
+          bucket = (struct bucket *)&buckets[idx * bucket_size];
+          rcu_read_lock();
+          magic = atomic_load_explicit(&bucket->magic, memory_order_acquire);
+          if (magic != 1)
+            {
+              rcu_read_unlock();
+              continue;
+            }
+          epoch = bucket->ibucket.epoch;
+          txid = bucket->txid;
+          rcu_read_unlock();
+
+          if (epoch && epoch < now)
+            {
+              if (lru_delete_bucket(lru, bucket, UINT64_MAX))
+                {
+                  swiper->expired++;
+                  round_expired++;
+                }
+            }
+          else if (txid < oldest_txid)
+            {
+              oldest = bucket;
+              oldest_txid = txid;
+            }
         }
+
+      objcnt = atomic_load_explicit(&lru->objcnt, memory_order_relaxed);
+      pressure = objcnt > threshold || lru_mem_used(lru) > mem_target;
+      if (pressure && oldest && lru_delete_bucket(lru, oldest, oldest_txid))
+        swiper->evicted++;
+      else
+        swiper->cursor++;
+      if (!pressure && round_expired * 4 <= LRU_EVICT_SAMPLES)
+        break;
     }
-  swiper->pqueue_used = 0;
+  swiper->cursor = 0;
+  return true;
+}
+
+// Only lowers the longest probe, so lru_swipe is the only writer that
+// can lower it and there is no aba problem.
+static void
+lru_swipe_longest_probes(lru_t *lru, lru_table *table)
+{
+  uint64_t idx;
+  unsigned int longest_probes, new_lp;
 
-  // update the longest probe. longest probe can only be decreased
-  // by this thread, this method, so we won't have the aba problem
   longest_probes
-      = atomic_load_explicit(&lru->longest_probes, memory_order_acquire);
+      = atomic_load_explicit(&table->longest_probes, memory_order_acquire);
   do
     {
       new_lp = 0;
@@ -1251,6 +2813,134 @@ lru_swipe(swiper_t *swiper)
         break;
     }
   while (atomic_compare_exchange_strong_explicit(
-      &lru->longest_probes, &longest_probes, new_lp, memory_order_release,
+      &table->longest_probes, &longest_probes, new_lp, memory_order_release,
       memory_order_acquire));
 }
+
+static bool
+lru_swipe_run(swiper_t *swiper, uint64_t max_buckets, uint64_t max_usec,
+              bool evict)
+{
+  lru_t *lru;
+  lru_table *table;
+  struct swipe_budget budget;
+  time_t now;
+  bool done;
+
+  lru = swiper->lru;
+  table = atomic_load_explicit(&lru->table, memory_order_acquire);
+  now = clock_now();
+  // A new pass, or the table was replaced by a resize under the pass
+  if (!swiper->resume || swiper->table_gen != table->gen)
+    {
+      swiper->table_gen = table->gen;
+      swiper->cursor = 0;
+      if (swiper->policy == SWIPE_SCAN)
+        swiper->cursor
+            = lru_table_capacity(table) * swiper->part / swiper->nparts;
+      swiper->clock = atomic_load_explicit(&lru->txid, memory_order_relaxed);
+      swiper->cutoff = 0;
+      swiper->evicting = false;
+      memset(swiper->hist, 0, sizeof(swiper->hist));
+      swiper->expired = 0;
+      swiper->evicted = 0;
+    }
+
+  budget.buckets = max_buckets;
+  budget.timed = max_usec > 0;
+  if (budget.timed)
+    {
+      clock_gettime(CLOCK_MONOTONIC, &budget.deadline);
+      budget.deadline.tv_sec += max_usec / 1000000;
+      budget.deadline.tv_nsec += max_usec % 1000000 * 1000;
+      if (budget.deadline.tv_nsec >= 1000000000)
+        {
+          budget.deadline.tv_sec++;
+          budget.deadline.tv_nsec -= 1000000000;
+        }
+    }
+
+  if (swiper->policy == SWIPE_SAMPLE)
+    done = lru_swipe_sample(swiper, table, now, &budget);
+  else
+    done = lru_swipe_scan(swiper, table, now, &budget, evict);
+  // The parts of a parallel swipe stay in the pass until lru_swipe_merge
+  // completes it.
+  swiper->resume = !done || !evict;
+  if (done && evict)
+    lru_swipe_longest_probes(lru, table);
+  return done;
+}
+
+// This method can only be executed by a single thread.
+bool
+lru_swipe_step(swiper_t *swiper, uint64_t max_buckets, uint64_t max_usec)
+{
+  return lru_swipe_run(swiper, max_buckets, max_usec, true);
+}
+
+bool
+lru_swipe_collect(swiper_t *swiper, uint64_t max_buckets, uint64_t max_usec)
+{
+  return lru_swipe_run(swiper, max_buckets, max_usec, false);
+}
+
+bool
+lru_swipe_merge(swiper_t **swipers, int nswipers)
+{
+  lru_t *lru;
+  lru_table *table;
+  uint64_t hist[LRU_HIST_SIZE], cutoff, expired, evicted;
+  bool stale = false;
+
+  lru = swipers[0]->lru;
+  table = atomic_load_explicit(&lru->table, memory_order_acquire);
+  // Parts of a replaced table, or restarted on the new one while the
+  // others were not, drop the pass.
+  for (int i = 0; i < nswipers; i++)
+    if (swipers[i]->table_gen != table->gen
+        || swipers[i]->evicting != swipers[0]->evicting)
+      stale = true;
+
+  if (!stale && !swipers[0]->evicting)
+    {
+      // The ages are relative to the clock of each part, which read the
+      // clock at about the same time.
+      memset(hist, 0, sizeof(hist));
+      for (int i = 0; i < nswipers; i++)
+        for (int idx = 0; idx < LRU_HIST_SIZE; idx++)
+          hist[idx] += swipers[i]->hist[idx];
+      cutoff = lru_hist_cutoff(hist, swipers[0]->clock,
+                               lru_swipe_num_to_del(lru, table));
+      if (cutoff)
+        {
+          for (int i = 0; i < nswipers; i++)
+            {
+              swipers[i]->cutoff = cutoff;
+              swipers[i]->evicting = true;
+              swipers[i]->cursor = lru_table_capacity(table)
+                                   * swipers[i]->part / swipers[i]->nparts;
+            }
+          return false;
+        }
+    }
+
+  expired = evicted = 0;
+  for (int i = 0; i < nswipers; i++)
+    {
+      expired += swipers[i]->expired;
+      evicted += swipers[i]->evicted;
+      swipers[i]->resume = false;
+    }
+  swipers[0]->expired = expired;
+  swipers[0]->evicted = evicted;
+  lru_swipe_longest_probes(lru, table);
+  return true;
+}
+
+void
+lru_swipe(swiper_t *swiper)
+{
+  while (!lru_swipe_step(swiper, 0, 0))
+    ;
+}
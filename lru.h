@@ -22,26 +22,139 @@
 
 #include "cmd_parser.h"
 #include <inttypes.h>
+#include <pthread.h>
 #include <stdatomic.h>
 #include <stdbool.h>
 #include <stdint.h>
 
 typedef struct lru_t lru_t;
+typedef struct lru_table lru_table;
 typedef struct lru_val_t lru_val_t;
 typedef struct swiper_t swiper_t;
 
 #define PROBE_STATS_SIZE 512
+// lru_swipe evicts the least recently updated items once the table holds
+// more objects than this.
+#define LRU_SWIPE_THRESHOLD(capacity) ((capacity)*7 / 10)
+// Once lru_mem_used exceeds lru_t.mem_limit, lru_swipe evicts the least
+// recently updated items until it drops below this. The slab chunks and
+// value slots it frees are kept for new items, their pages are not
+// returned to the system before lru_cleanup, so the resident size does
+// not shrink with lru_mem_used.
+#define LRU_MEM_LOW_WATER(limit) ((limit)*9 / 10)
+// Writers take txids from ranges of LRU_TXID_BATCH they reserve from
+// lru_t.txid. A range is dropped once lru_t.txid moved LRU_TXID_STALE
+// past it, which bounds how far the recency order can be off.
+#define LRU_TXID_BATCH 64
+#define LRU_TXID_STALE (64 * LRU_TXID_BATCH)
+// Buckets lru_swipe looks at per round with SWIPE_SAMPLE
+#define LRU_EVICT_SAMPLES 16
+// A hit only refreshes the recency of a bucket that is older than this
+// many txids, so that hot keys are not written on every read.
+#define LRU_TOUCH_WINDOW 1024
+// Deleted buckets stay tombstones that lookups probe past until an
+// insert reuses them. lru_compact moves the items to a fresh table of
+// the same size once this many of the buckets are tombstones.
+#define LRU_COMPACT_THRESHOLD(capacity) ((capacity) / 4)
+// buckets of the old table a writer moves along with its own item
+#define LRU_MIGRATE_STEP 8
+// Tables are mapped with MAP_HUGETLB pages of this size if lru_hugetlb
+// is set when they are allocated, with transparent huge pages otherwise.
+#define LRU_HUGE_PAGE (2UL << 20)
+// Hits are counted per numa node modulo LRU_NUMA_NODES. Tables are
+// interleaved over at most LRU_MAX_NODES nodes.
+#define LRU_NUMA_NODES 8
+#define LRU_MAX_NODES 1024
+// A SWIPE_SCAN swipe counts the items by the age of their txid in
+// 1 << LRU_HIST_SUB_BITS buckets per power of two.
+#define LRU_HIST_SUB_BITS 4
+#define LRU_HIST_SIZE (64 << LRU_HIST_SUB_BITS)
 
-struct lru_t
+// Updates in flight hold a tmp bucket each until a grace period ends.
+// A tmp bucket index is 16 bits wide: shard * LRU_TMP_SHARD_SIZE + slot.
+#define LRU_TMP_SHARD_SIZE 64
+#define LRU_TMP_SHARDS 1024
+
+struct lru_tmp_shard
+{
+  atomic_ullong bmap;
+  uint8_t *_Atomic buckets;
+} __attribute__((aligned(64)));
+
+// Values too large for the bucket are stored in a slot of the smallest
+// value class that holds them: slot arrays of 64 B, 256 B, 1 KB and 4 KB
+// carved from LRU_VAL_PAGE_SIZE pages, so that buckets only need room
+// for small values. Larger values are left to the slab. A class is split
+// into LRU_VAL_SHARDS shards, a thread takes slots from its own.
+#define LRU_VAL_CLASSES 4
+#define LRU_VAL_CLASS_SIZE(cls) ((size_t)64 << (2 * (cls)))
+#define LRU_VAL_CLASS_MAX LRU_VAL_CLASS_SIZE(LRU_VAL_CLASSES - 1)
+#define LRU_VAL_PAGE_SIZE (256 * 1024)
+#define LRU_VAL_SHARDS 16
+
+struct lru_val_shard
 {
+  pthread_mutex_t lock;
+  size_t slot_size;
+  // free slots, linked through their first word
+  void *free_list;
+  // page being carved, and slots left in it
+  uint8_t *page;
+  size_t page_left;
+  // pages mapped so far, linked through their first slot
+  void *pages;
+} __attribute__((aligned(64)));
+
+// An array of buckets. During a resize the items are moved from
+// lru_t.old_table to lru_t.table.
+struct lru_table
+{
+  // tells tables apart even if one is allocated where another was freed
+  uint64_t gen;
   uint8_t capacity_clz;
   uint8_t capacity_ms4b;
+  atomic_uint longest_probes;
+  // The buckets and the tags share one mapping of map_size bytes. thp is
+  // set if transparent huge pages were asked for in place of page_size.
+  size_t map_size;
+  size_t page_size;
+  bool thp;
+  uint8_t *buckets;
+  // One byte per bucket, so that a probe group fits in a load: 0 if the
+  // bucket was never used, else 0x80 | 7 bits of the hash of the last
+  // key written to it. Lookups only look at the buckets that match.
+  uint8_t *tags;
+};
+
+struct lru_t
+{
   size_t inline_keylen;
   size_t inline_vallen;
 
-  atomic_uint longest_probes;
+  lru_table *_Atomic table;
+  // table being emptied by a resize, NULL otherwise
+  lru_table *_Atomic old_table;
+  // next bucket of old_table to move, and number of buckets moved
+  atomic_ullong migrate_next;
+  atomic_ullong migrate_done;
+
   atomic_ullong objcnt;
+  // buckets of table and old_table left as tombstones by deletes
+  atomic_ullong tombstones;
+  // bytes of bucket tables and of the out of line keys and values, 0 for
+  // no limit
+  uint64_t mem_limit;
+  // tells the txid ranges of two lru_t apart, never reused
+  uint64_t id;
+  // end of the txids reserved so far, read as the clock by hits
   atomic_ullong txid;
+  uint64_t touch_window;
+  // hits that left the recency alone, counted LRU_TXID_BATCH at a time
+  atomic_ullong touch_skipped;
+  // threads lru_resize prefaults a new table with, 0 to leave it alone
+  int prefault_threads;
+  // hits by the node of the thread that looked the key up
+  atomic_ullong node_hits[LRU_NUMA_NODES];
   atomic_uint probe_stats[PROBE_STATS_SIZE];
 
   atomic_ullong inline_acc_keylen;
@@ -50,10 +163,19 @@ struct lru_t
   atomic_uint ninline_valcnt;
   atomic_ullong ninline_keylen;
   atomic_ullong ninline_vallen;
+  // bytes of the slab chunks and value slots holding the out of line
+  // keys and values, above their lengths by the rounding to their class
+  atomic_ullong out_bytes;
+  // value slots in use by value class
+  atomic_ullong val_slots[LRU_VAL_CLASSES];
 
-  atomic_ullong tmp_bucket_bmap;
-  uint8_t *buckets;
-  uint8_t *tmp_buckets;
+  // reclamations queued with call_rcu that did not run yet
+  atomic_uint deferred_cnt;
+
+  // LRU_TMP_SHARDS shards of LRU_TMP_SHARD_SIZE tmp buckets
+  struct lru_tmp_shard *tmp_shards;
+  // LRU_VAL_SHARDS shards of each value class, class by class
+  struct lru_val_shard *val_shards;
 };
 
 struct lru_val_t
@@ -64,31 +186,93 @@ struct lru_val_t
   void *value;
   uint64_t cas;
   uint16_t flags;
+  // version of the bucket lru_get read the item from
+  const atomic_uint *seqp;
+  unsigned int seq;
 };
 
+// Every bucket has room for inline_keylen bytes of key and
+// inline_vallen bytes of value. Larger keys are stored in a slab chunk,
+// larger values in a slot of their value class, see LRU_VAL_CLASSES.
 lru_t *lru_init(uint64_t num_objects, size_t inline_keylen,
                 size_t inline_vallen);
+extern bool lru_hugetlb;
+// Tables allocated while set are interleaved over the numa nodes
+extern bool lru_interleave;
+// Fault in the pages of the table with nthreads threads, before the
+// table is used. Tables of later resizes are prefaulted as well.
+void lru_prefault(lru_t *lru, int nthreads);
 void lru_cleanup(lru_t *lru);
 uint64_t lru_capacity(lru_t *lru);
+uint64_t lru_mem_used(lru_t *lru);
 bool lru_get(lru_t *lru, cmd_handler *cmd, lru_val_t *lru_val);
 bool lru_upsert(lru_t *lru, cmd_handler *cmd, lru_val_t *lru_val);
 void lru_delete(lru_t *lru, cmd_handler *cmd);
+// False if the item returned by lru_get was overwritten in place since,
+// the caller has to discard what it copied and retry.
+bool lru_val_valid(lru_val_t *lru_val);
+// Start moving the items to a new table sized for num_objects. Fails
+// if a resize is in progress or the items would not fit. lru_migrate
+// moves nbuckets buckets at a time and returns true once all are moved,
+// then lru_resize_end, which waits for a grace period, frees the old
+// table. Writers help moving buckets as well.
+bool lru_resize(lru_t *lru, uint64_t num_objects);
+// Resize to the current size if LRU_COMPACT_THRESHOLD tombstones piled
+// up, so that misses end at an empty bucket again and longest_probes
+// starts over. Fails like lru_resize, or if there are fewer tombstones.
+bool lru_compact(lru_t *lru);
+bool lru_migrate(lru_t *lru, uint64_t nbuckets);
+void lru_resize_end(lru_t *lru);
+
+enum swipe_policy
+{
+  // scan the whole table, then evict the items older than a cutoff
+  // taken from a histogram of the txids
+  SWIPE_SCAN,
+  // evict the oldest of random samples, cost follows the items freed
+  SWIPE_SAMPLE,
+};
 
 struct swiper_t
 {
   lru_t *lru;
-  uint32_t pqueue_size;
-  uint32_t pqueue_used;
-  // pqueue[x][0] is idx of the bucket
-  // pqueue[x][1] is txid
-  uint64_t pqueue[0][2];
+  enum swipe_policy policy;
+  // this swiper scans part [0, nparts) of the table
+  uint32_t part;
+  uint32_t nparts;
+  uint64_t rand_state;
+  // where lru_swipe_step resumes the pass over the table of table_gen:
+  // the next bucket with SWIPE_SCAN, the idle rounds with SWIPE_SAMPLE
+  bool resume;
+  uint64_t cursor;
+  uint64_t table_gen;
+  // SWIPE_SCAN: lru_t.txid when the pass started, which the ages in hist
+  // are relative to, and the txid the evicting pass deletes up to
+  uint64_t clock;
+  uint64_t cutoff;
+  bool evicting;
+  // number of items deleted by the last complete swipe
+  uint64_t expired;
+  uint64_t evicted;
+  uint64_t hist[LRU_HIST_SIZE];
   // TODO add mutex for flush_all
 };
 
-swiper_t *swiper_init(lru_t *lru, uint32_t pq_size);
-void pq_add(swiper_t *swiper, uint64_t idx, uint64_t txid);
-void pq_pop_add(swiper_t *swiper, uint64_t idx, uint64_t txid);
-void pq_sort(swiper_t *swiper);
+swiper_t *swiper_init(lru_t *lru);
 void lru_swipe(swiper_t *swiper);
+// Continue the current swipe for at most max_buckets buckets or max_usec
+// microseconds, 0 for no bound. Returns true once the swipe is complete,
+// expired and evicted are only final then.
+bool lru_swipe_step(swiper_t *swiper, uint64_t max_buckets,
+                    uint64_t max_usec);
+// A SWIPE_SCAN swipe split over nswipers threads: swiper i with part i
+// and nparts nswipers runs its part of the table with lru_swipe_collect
+// until it returns true, then lru_swipe_merge is called. After the first
+// pass, which only expires items, it sets the cutoff over all the parts
+// and returns false, the parts run again to evict. Once it returns true
+// expired and evicted of swipers[0] are the totals.
+bool lru_swipe_collect(swiper_t *swiper, uint64_t max_buckets,
+                       uint64_t max_usec);
+bool lru_swipe_merge(swiper_t **swipers, int nswipers);
 
 #endif
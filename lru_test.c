@@ -18,6 +18,8 @@
  */
 
 #include "lru.h"
+#include "clock.h"
+#include "slab.h"
 #include <limits.h>
 #include <setjmp.h>
 #include <stdarg.h>
@@ -26,9 +28,16 @@
 #include <stdio.h>
 #include <string.h>
 #include <sys/mman.h>
-#include <urcu.h>
+#include <urcu-qsbr.h>
 #include <cmocka.h>
 
+// The tests run on the cached clock and move it by hand
+static void
+clock_pass(time_t secs)
+{
+  atomic_fetch_add_explicit(&clock_secs, secs, memory_order_relaxed);
+}
+
 static void
 test_init_cleanup(void **context)
 {
@@ -755,32 +764,406 @@ test_lru_delete(void **context)
   free(lru);
 }
 
+// Chunks in use in the slab class a value of size bytes goes to
+static uint64_t
+slab_used_for(size_t size)
+{
+  struct slab_stats stats;
+
+  for (int cls = 0; slab_class_stats(cls, &stats); cls++)
+    if (!stats.chunk_size || stats.chunk_size >= size)
+      return stats.used;
+  return 0;
+}
+
+static void
+test_value_classes(void **context)
+{
+  lru_t *lru;
+  cmd_handler cmd;
+  lru_val_t lru_val;
+  char value[5000];
+  const size_t sizes[] = { 20, 40, 200, 1000, 3000, 5000 };
+  uint64_t used_large;
+  lru = lru_init(100, 8, 32);
+
+  cmd.state = ASCII_CMD_READY;
+  cmd.req.op = PROTOCOL_BINARY_CMD_SET;
+  cmd.key = &cmd.buffer[0];
+  cmd.req.keylen = 3;
+  cmd.req.cas = 0;
+  cmd.value = value;
+  cmd.extra.twoval.expiration = 900;
+  used_large = slab_used_for(5000);
+
+  // The first value stays in the bucket, the next ones take a slot of
+  // each value class and the last one a slab chunk.
+  for (int i = 0; i < 6; i++)
+    {
+      snprintf(cmd.buffer, 4, "k%02d", i);
+      memset(value, 'a' + i, sizes[i]);
+      cmd.value_stored = sizes[i];
+      assert_true(lru_upsert(lru, &cmd, &lru_val));
+    }
+  for (int cls = 0; cls < LRU_VAL_CLASSES; cls++)
+    assert_int_equal(1, lru->val_slots[cls]);
+  assert_int_equal(used_large + 1, slab_used_for(5000));
+  assert_int_equal(5, lru->ninline_valcnt);
+  assert_int_equal(64 + 256 + 1024 + 4096 + slab_chunk_size(5000),
+                   lru->out_bytes);
+  cmd.req.op = PROTOCOL_BINARY_CMD_GET;
+  for (int i = 0; i < 6; i++)
+    {
+      snprintf(cmd.buffer, 4, "k%02d", i);
+      assert_true(lru_get(lru, &cmd, &lru_val));
+      assert_int_equal(sizes[i], lru_val.vallen);
+      assert_int_equal('a' + i, ((char *)lru_val.value)[sizes[i] - 1]);
+    }
+
+  // Shrinking a value moves it into the bucket, its slot is released
+  // after a grace period and taken again by the next value of its class.
+  cmd.req.op = PROTOCOL_BINARY_CMD_SET;
+  snprintf(cmd.buffer, 4, "k%02d", 2);
+  cmd.value_stored = 20;
+  assert_true(lru_upsert(lru, &cmd, &lru_val));
+  rcu_thread_offline();
+  synchronize_rcu();
+  rcu_barrier();
+  rcu_thread_online();
+  assert_int_equal(0, lru->val_slots[1]);
+  snprintf(cmd.buffer, 4, "k%02d", 6);
+  cmd.value_stored = 100;
+  assert_true(lru_upsert(lru, &cmd, &lru_val));
+  assert_int_equal(1, lru->val_slots[1]);
+
+  lru_cleanup(lru);
+  for (int cls = 0; cls < LRU_VAL_CLASSES; cls++)
+    assert_int_equal(0, lru->val_slots[cls]);
+  assert_int_equal(0, lru->out_bytes);
+  assert_int_equal(used_large, slab_used_for(5000));
+  free(lru);
+}
+
+static void
+test_upsert_enomem(void **context)
+{
+  lru_t *lru;
+  cmd_handler cmd;
+  lru_val_t lru_val;
+  char value[16];
+  uint64_t used_large;
+  lru = lru_init(100, 8, 8);
+
+  cmd.state = ASCII_CMD_READY;
+  cmd.req.op = PROTOCOL_BINARY_CMD_SET;
+  cmd.key = &cmd.buffer[0];
+  cmd.req.keylen = 3;
+  cmd.req.cas = 0;
+  cmd.value = value;
+  cmd.extra.twoval.expiration = 900;
+  memset(value, 'v', sizeof(value));
+  memcpy(&cmd.buffer, "abc", 3);
+  used_large = slab_used_for(SIZE_MAX / 4);
+
+  // No memory for the value, the bucket stays free
+  cmd.value_stored = SIZE_MAX / 4;
+  assert_false(lru_upsert(lru, &cmd, &lru_val));
+  assert_int_equal(PROTOCOL_BINARY_RESPONSE_ENOMEM, lru_val.rescode);
+  assert_int_equal(0, lru->objcnt);
+  assert_int_equal(0, lru->ninline_valcnt);
+  assert_int_equal(used_large, slab_used_for(SIZE_MAX / 4));
+  cmd.req.op = PROTOCOL_BINARY_CMD_GET;
+  assert_false(lru_get(lru, &cmd, &lru_val));
+
+  // Failed updates leave the value as it was
+  cmd.req.op = PROTOCOL_BINARY_CMD_SET;
+  cmd.value_stored = sizeof(value);
+  assert_true(lru_upsert(lru, &cmd, &lru_val));
+  cmd.value_stored = SIZE_MAX / 4;
+  assert_false(lru_upsert(lru, &cmd, &lru_val));
+  assert_int_equal(PROTOCOL_BINARY_RESPONSE_ENOMEM, lru_val.rescode);
+  cmd.req.op = PROTOCOL_BINARY_CMD_APPEND;
+  assert_false(lru_upsert(lru, &cmd, &lru_val));
+  assert_int_equal(PROTOCOL_BINARY_RESPONSE_ENOMEM, lru_val.rescode);
+  cmd.req.op = PROTOCOL_BINARY_CMD_GET;
+  assert_true(lru_get(lru, &cmd, &lru_val));
+  assert_int_equal(sizeof(value), lru_val.vallen);
+  assert_int_equal(1, lru->objcnt);
+  assert_int_equal(1, lru->ninline_valcnt);
+
+  lru_cleanup(lru);
+  assert_int_equal(used_large, slab_used_for(SIZE_MAX / 4));
+  free(lru);
+}
+
+static void
+test_table_pages(void **context)
+{
+  lru_t *lru;
+  lru_table *table;
+  cmd_handler cmd;
+  lru_val_t lru_val;
+
+  lru = lru_init(100000, 8, 8);
+  table = lru->table;
+  assert_int_equal(0, table->map_size % table->page_size);
+  assert_true(table->tags + lru_capacity(lru) + 3
+              <= table->buckets + table->map_size);
+  assert_int_equal(lru_mem_used(lru), table->map_size);
+
+  // Prefaulting leaves the empty table as it is
+  lru_prefault(lru, 3);
+  for (uint64_t idx = 0; idx < lru_capacity(lru); idx++)
+    assert_int_equal(0, table->tags[idx]);
+
+  cmd.state = ASCII_CMD_READY;
+  cmd.req.op = PROTOCOL_BINARY_CMD_SET;
+  cmd.key = &cmd.buffer[0];
+  cmd.buf_used = 3;
+  cmd.req.keylen = 3;
+  cmd.req.cas = 0;
+  cmd.value_stored = 0;
+  cmd.extra.twoval.expiration = 900;
+  memcpy(&cmd.buffer, "abc", 3);
+  assert_true(lru_upsert(lru, &cmd, &lru_val));
+
+  // Tables of a resize are prefaulted too
+  assert_true(lru_resize(lru, 200000));
+  while (!lru_migrate(lru, UINT64_MAX))
+    ;
+  lru_resize_end(lru);
+  cmd.req.op = PROTOCOL_BINARY_CMD_GET;
+  assert_true(lru_get(lru, &cmd, &lru_val));
+  lru_cleanup(lru);
+  free(lru);
+
+  // Without reserved huge pages the table falls back to normal pages
+  lru_hugetlb = true;
+  lru = lru_init(100, 8, 8);
+  lru_hugetlb = false;
+  assert_non_null(lru);
+  assert_true(lru->table->page_size == LRU_HUGE_PAGE
+              || !(lru->table->map_size % lru->table->page_size));
+  // More threads than pages, every page is still faulted in once
+  lru_prefault(lru, 1000);
+  for (uint64_t idx = 0; idx < lru_capacity(lru); idx++)
+    assert_int_equal(0, lru->table->tags[idx]);
+  lru_cleanup(lru);
+  free(lru);
+}
+
+static void
+test_numa(void **context)
+{
+  lru_t *lru;
+  cmd_handler cmd;
+  lru_val_t lru_val;
+  uint64_t hits;
+
+  // Interleaving is best effort, the table works either way
+  lru_interleave = true;
+  lru = lru_init(1000, 8, 8);
+  lru_interleave = false;
+  assert_non_null(lru);
+
+  cmd.state = ASCII_CMD_READY;
+  cmd.req.op = PROTOCOL_BINARY_CMD_SET;
+  cmd.key = &cmd.buffer[0];
+  cmd.buf_used = 3;
+  cmd.req.keylen = 3;
+  cmd.req.cas = 0;
+  cmd.value_stored = 0;
+  cmd.extra.twoval.expiration = 900;
+  memcpy(&cmd.buffer, "abc", 3);
+  assert_true(lru_upsert(lru, &cmd, &lru_val));
+
+  // Hits are added to the node a batch at a time, misses are not counted
+  cmd.req.op = PROTOCOL_BINARY_CMD_GET;
+  for (int i = 0; i < LRU_TXID_BATCH * 2 + 1; i++)
+    assert_true(lru_get(lru, &cmd, &lru_val));
+  memcpy(&cmd.buffer, "xyz", 3);
+  for (int i = 0; i < LRU_TXID_BATCH; i++)
+    assert_false(lru_get(lru, &cmd, &lru_val));
+  hits = 0;
+  for (int node = 0; node < LRU_NUMA_NODES; node++)
+    hits += lru->node_hits[node];
+  assert_int_equal(LRU_TXID_BATCH * 2, hits);
+
+  lru_cleanup(lru);
+  free(lru);
+}
+
+static void
+test_tags(void **context)
+{
+  lru_t *lru;
+  cmd_handler cmd;
+  lru_val_t lru_val;
+  uint64_t capacity, tagged;
+  lru = lru_init(100, 8, 8);
+  capacity = lru_capacity(lru);
+
+  cmd.state = ASCII_CMD_READY;
+  cmd.req.op = PROTOCOL_BINARY_CMD_SET;
+  cmd.key = &cmd.buffer[0];
+  cmd.buf_used = 3;
+  cmd.req.keylen = 3;
+  cmd.req.cas = 0;
+  cmd.value_stored = 0;
+  cmd.extra.twoval.expiration = 900;
+  for (int i = 0; i < 60; i++)
+    {
+      sprintf(&cmd.buffer[0], "%03d", i);
+      assert_true(lru_upsert(lru, &cmd, &lru_val));
+    }
+
+  // Every item has a tag, nothing else does yet
+  tagged = 0;
+  for (uint64_t idx = 0; idx < capacity; idx++)
+    if (lru->table->tags[idx])
+      {
+        assert_true(lru->table->tags[idx] & 0x80);
+        tagged++;
+      }
+  assert_int_equal(60, tagged);
+
+  // Deleted items keep their stale tag, lookups still find the rest and
+  // end on the buckets that were never used.
+  cmd.req.op = PROTOCOL_BINARY_CMD_DELETE;
+  for (int i = 0; i < 60; i += 2)
+    {
+      sprintf(&cmd.buffer[0], "%03d", i);
+      lru_delete(lru, &cmd);
+    }
+  cmd.req.op = PROTOCOL_BINARY_CMD_GET;
+  for (int i = 0; i < 100; i++)
+    {
+      sprintf(&cmd.buffer[0], "%03d", i);
+      assert_int_equal(i < 60 && i % 2, lru_get(lru, &cmd, &lru_val));
+    }
+
+  lru_cleanup(lru);
+  free(lru);
+}
+
+static void
+test_compact(void **context)
+{
+  lru_t *lru;
+  lru_table *table;
+  cmd_handler cmd;
+  lru_val_t lru_val;
+  uint64_t capacity, tagged;
+  lru = lru_init(100, 8, 8);
+  capacity = lru_capacity(lru);
+
+  cmd.state = ASCII_CMD_READY;
+  cmd.req.op = PROTOCOL_BINARY_CMD_SET;
+  cmd.key = &cmd.buffer[0];
+  cmd.buf_used = 3;
+  cmd.req.keylen = 3;
+  cmd.req.cas = 0;
+  cmd.value_stored = 0;
+  cmd.extra.twoval.expiration = 900;
+  for (int i = 0; i < 60; i++)
+    {
+      sprintf(&cmd.buffer[0], "%03d", i);
+      assert_true(lru_upsert(lru, &cmd, &lru_val));
+    }
+  assert_false(lru_compact(lru));
+
+  // Deleted buckets become tombstones once a grace period ended
+  cmd.req.op = PROTOCOL_BINARY_CMD_DELETE;
+  for (int i = 0; i < 60; i++)
+    if (i % 3)
+      {
+        sprintf(&cmd.buffer[0], "%03d", i);
+        lru_delete(lru, &cmd);
+      }
+  rcu_barrier();
+  assert_int_equal(40, lru->tombstones);
+  assert_true(40 >= LRU_COMPACT_THRESHOLD(capacity));
+
+  table = lru->table;
+  assert_true(lru_compact(lru));
+  assert_true(lru->table != table);
+  while (!lru_migrate(lru, UINT64_MAX))
+    ;
+  lru_resize_end(lru);
+
+  // Same size, only the live items are left and tagged
+  assert_int_equal(capacity, lru_capacity(lru));
+  assert_int_equal(0, lru->tombstones);
+  assert_int_equal(20, lru->objcnt);
+  tagged = 0;
+  for (uint64_t idx = 0; idx < capacity; idx++)
+    if (lru->table->tags[idx])
+      tagged++;
+  assert_int_equal(20, tagged);
+  cmd.req.op = PROTOCOL_BINARY_CMD_GET;
+  for (int i = 0; i < 100; i++)
+    {
+      sprintf(&cmd.buffer[0], "%03d", i);
+      assert_int_equal(i < 60 && !(i % 3), lru_get(lru, &cmd, &lru_val));
+    }
+  assert_false(lru_compact(lru));
+
+  lru_cleanup(lru);
+  free(lru);
+}
+
 static void
-test_swiper_pqueue(void **context)
-{
-  swiper_t *swiper = swiper_init(NULL, 4);
-  pq_add(swiper, 0, 3);
-  pq_add(swiper, 1, 7);
-  pq_add(swiper, 2, 1);
-  pq_add(swiper, 3, 5);
-  assert_int_equal(4, swiper->pqueue_used);
-
-  assert_int_equal(7, swiper->pqueue[0][1]);
-  pq_pop_add(swiper, 4, 2);
-  assert_int_equal(5, swiper->pqueue[0][1]);
-  pq_pop_add(swiper, 0, 9);
-  assert_int_equal(5, swiper->pqueue[0][1]);
-  // now the set contains (2,1), (4,2), (0,3), (3,5)
-  pq_sort(swiper);
-  assert_int_equal(2, swiper->pqueue[0][0]);
-  assert_int_equal(1, swiper->pqueue[0][1]);
-  assert_int_equal(4, swiper->pqueue[1][0]);
-  assert_int_equal(2, swiper->pqueue[1][1]);
-  assert_int_equal(0, swiper->pqueue[2][0]);
-  assert_int_equal(3, swiper->pqueue[2][1]);
-  assert_int_equal(3, swiper->pqueue[3][0]);
-  assert_int_equal(5, swiper->pqueue[3][1]);
+test_swiper_cutoff(void **context)
+{
+  lru_t *lru;
+  swiper_t *swiper;
+  cmd_handler cmd;
+  lru_val_t lru_val;
+  uint64_t threshold;
+  int newest_evicted, oldest_kept;
+  lru = lru_init(1000, 8, 8);
+  swiper = swiper_init(lru);
+  threshold = LRU_SWIPE_THRESHOLD(lru_capacity(lru));
+
+  cmd.state = ASCII_CMD_READY;
+  cmd.req.op = PROTOCOL_BINARY_CMD_SET;
+  cmd.key = &cmd.buffer[0];
+  cmd.buf_used = 4;
+  cmd.req.keylen = 4;
+  cmd.req.cas = 0;
+  cmd.value_stored = 0;
+  cmd.extra.twoval.expiration = 900;
+  for (int i = 0; i < threshold + 200; i++)
+    {
+      sprintf(&cmd.buffer[0], "%04d", i);
+      assert_true(lru_upsert(lru, &cmd, &lru_val));
+    }
+
+  // The histogram is exact for consecutive txids, only the oldest items
+  // go.
+  lru_swipe(swiper);
+  assert_int_equal(threshold, lru->objcnt);
+  assert_int_equal(200, swiper->evicted);
+  newest_evicted = -1;
+  oldest_kept = threshold + 200;
+  for (int i = 0; i < threshold + 200; i++)
+    {
+      sprintf(&cmd.buffer[0], "%04d", i);
+      if (lru_get(lru, &cmd, &lru_val))
+        oldest_kept = i < oldest_kept ? i : oldest_kept;
+      else
+        newest_evicted = i;
+    }
+  assert_int_equal(199, newest_evicted);
+  assert_int_equal(200, oldest_kept);
 
+  // Under the threshold a pass only scans once
+  lru_swipe(swiper);
+  assert_int_equal(0, swiper->evicted);
+  assert_false(swiper->evicting);
+
+  lru_cleanup(lru);
+  free(lru);
   free(swiper);
 }
 
@@ -792,7 +1175,7 @@ test_swiper_epoch(void **context)
   cmd_handler cmd;
   lru_val_t lru_val;
   lru = lru_init(100, 8, 8);
-  swiper = swiper_init(lru, 20);
+  swiper = swiper_init(lru);
 
   cmd.state = ASCII_CMD_READY;
   cmd.req.op = PROTOCOL_BINARY_CMD_SET;
@@ -801,11 +1184,11 @@ test_swiper_epoch(void **context)
   cmd.req.keylen = 3;
   cmd.req.cas = 0;
   cmd.value_stored = 0;
-  cmd.extra.twoval.expiration = 0;
+  cmd.extra.twoval.expiration = 1;
   memcpy(&cmd.buffer, "abc", 3);
   assert_true(lru_upsert(lru, &cmd, &lru_val));
 
-  sleep(1);
+  clock_pass(2);
   // now all epoch is out of date
   lru_swipe(swiper);
   assert_int_equal(0, lru->objcnt);
@@ -819,11 +1202,15 @@ test_swiper_epoch(void **context)
   cmd.extra.twoval.expiration = 900;
   memcpy(&cmd.buffer, "xyz", 3);
   assert_true(lru_upsert(lru, &cmd, &lru_val));
+  // An expiration of 0 never expires
+  cmd.extra.twoval.expiration = 0;
+  memcpy(&cmd.buffer, "ijk", 3);
+  assert_true(lru_upsert(lru, &cmd, &lru_val));
 
-  sleep(1);
+  clock_pass(1);
   lru_swipe(swiper);
-  assert_int_equal(1, lru->objcnt);
-  assert_int_equal(3, lru->inline_acc_keylen);
+  assert_int_equal(2, lru->objcnt);
+  assert_int_equal(6, lru->inline_acc_keylen);
   assert_int_equal(0, lru->inline_acc_vallen);
   assert_int_equal(0, lru->ninline_keycnt);
   assert_int_equal(0, lru->ninline_valcnt);
@@ -851,7 +1238,7 @@ test_swiper_txid(void **context)
   lru_val_t lru_val;
   uint64_t objcnt;
   lru = lru_init(70, 8, 8);
-  swiper = swiper_init(lru, 40);
+  swiper = swiper_init(lru);
 
   cmd.state = ASCII_CMD_READY;
   cmd.req.op = PROTOCOL_BINARY_CMD_SET;
@@ -903,7 +1290,7 @@ test_touch(void **context)
   cmd_handler cmd;
   lru_val_t lru_val;
   lru = lru_init(100, 8, 8);
-  swiper = swiper_init(lru, 20);
+  swiper = swiper_init(lru);
 
   cmd.state = ASCII_CMD_READY;
   cmd.req.op = PROTOCOL_BINARY_CMD_SET;
@@ -919,7 +1306,7 @@ test_touch(void **context)
   cmd.req.op = PROTOCOL_BINARY_CMD_TOUCH;
   cmd.extra.twoval.expiration = 900;
   assert_true(lru_upsert(lru, &cmd, &lru_val));
-  sleep(1);
+  clock_pass(1);
   lru_swipe(swiper);
   assert_int_equal(1, lru->objcnt);
   assert_int_equal(3, lru->inline_acc_keylen);
@@ -941,22 +1328,697 @@ test_touch(void **context)
   free(swiper);
 }
 
-int
-main(void)
+static void
+test_update_delete_deferred(void **context)
 {
-  const struct CMUnitTest lru_tests[] = {
-    cmocka_unit_test(test_init_cleanup),
-    cmocka_unit_test(test_insert_update),
-    cmocka_unit_test(test_numeric_val),
-    cmocka_unit_test(test_add_replace),
-    cmocka_unit_test(test_append_prepend),
-    cmocka_unit_test(test_numeric_append_prepend),
-    cmocka_unit_test(test_lru_full),
-    cmocka_unit_test(test_lru_delete),
-    cmocka_unit_test(test_swiper_pqueue),
-    cmocka_unit_test(test_swiper_epoch),
-    cmocka_unit_test(test_swiper_txid),
-    cmocka_unit_test(test_touch),
-  };
-  return cmocka_run_group_tests(lru_tests, NULL, NULL);
+  lru_t *lru;
+  cmd_handler cmd;
+  lru_val_t lru_val;
+  char value[16];
+  lru = lru_init(100, 8, 8);
+
+  cmd.state = ASCII_CMD_READY;
+  memcpy(&cmd.buffer, "abc", 3);
+  cmd.key = &cmd.buffer[0];
+  cmd.buf_used = 3;
+  cmd.req.keylen = 3;
+  cmd.req.cas = 0;
+
+  // Updates follow each other faster than they get committed
+  for (int i = 0; i < 10; i++)
+    {
+      cmd.req.op = PROTOCOL_BINARY_CMD_SET;
+      snprintf(value, sizeof(value), "value-%010d", i);
+      cmd.value = value;
+      cmd.value_stored = 16;
+      assert_true(lru_upsert(lru, &cmd, &lru_val));
+
+      cmd.req.op = PROTOCOL_BINARY_CMD_GET;
+      assert_true(lru_get(lru, &cmd, &lru_val));
+      assert_int_equal(16, lru_val.vallen);
+      assert_int_equal(i + 1, lru_val.cas);
+      assert_memory_equal(value, lru_val.value, 16);
+    }
+  assert_int_equal(1, lru->objcnt);
+  assert_int_equal(1, lru->ninline_valcnt);
+  assert_int_equal(16, lru->ninline_vallen);
+
+  // Deleting the item is visible right away, its memory is reclaimed
+  // later.
+  lru_delete(lru, &cmd);
+  assert_false(lru_get(lru, &cmd, &lru_val));
+  assert_int_equal(0, lru->objcnt);
+  assert_int_equal(0, lru->inline_acc_keylen);
+  assert_int_equal(0, lru->ninline_valcnt);
+  assert_int_equal(0, lru->ninline_vallen);
+
+  lru_cleanup(lru);
+  assert_int_equal(0, lru->deferred_cnt);
+  free(lru);
+}
+
+static void
+test_inplace_update(void **context)
+{
+  lru_t *lru;
+  cmd_handler cmd;
+  lru_val_t lru_val, old_val;
+  lru = lru_init(100, 8, 8);
+
+  cmd.state = ASCII_CMD_READY;
+  memcpy(&cmd.buffer, "abc", 3);
+  cmd.key = &cmd.buffer[0];
+  cmd.buf_used = 3;
+  cmd.req.keylen = 3;
+  cmd.req.cas = 0;
+  cmd.req.op = PROTOCOL_BINARY_CMD_SET;
+  cmd.value = "abc";
+  cmd.value_stored = 3;
+  assert_true(lru_upsert(lru, &cmd, &lru_val));
+
+  cmd.req.op = PROTOCOL_BINARY_CMD_GET;
+  assert_true(lru_get(lru, &cmd, &old_val));
+  assert_true(lru_val_valid(&old_val));
+
+  // Inline to inline is overwritten in place, a reader holding the old
+  // version notices.
+  cmd.req.op = PROTOCOL_BINARY_CMD_SET;
+  cmd.value = "xyz";
+  assert_true(lru_upsert(lru, &cmd, &lru_val));
+  assert_false(lru_val_valid(&old_val));
+  assert_int_equal(0, lru->deferred_cnt);
+
+  cmd.req.op = PROTOCOL_BINARY_CMD_GET;
+  assert_true(lru_get(lru, &cmd, &lru_val));
+  assert_true(lru_val_valid(&lru_val));
+  assert_int_equal(3, lru_val.vallen);
+  assert_int_equal(2, lru_val.cas);
+  assert_memory_equal("xyz", lru_val.value, 3);
+  assert_int_equal(3, lru->inline_acc_vallen);
+
+  cmd.req.op = PROTOCOL_BINARY_CMD_APPEND;
+  cmd.value = "12345";
+  cmd.value_stored = 5;
+  assert_true(lru_upsert(lru, &cmd, &lru_val));
+  cmd.req.op = PROTOCOL_BINARY_CMD_GET;
+  assert_true(lru_get(lru, &cmd, &lru_val));
+  assert_int_equal(8, lru_val.vallen);
+  assert_memory_equal("xyz12345", lru_val.value, 8);
+  assert_int_equal(8, lru->inline_acc_vallen);
+  assert_int_equal(0, lru->ninline_valcnt);
+
+  lru_cleanup(lru);
+  assert_int_equal(0, lru->objcnt);
+  assert_int_equal(0, lru->inline_acc_keylen);
+  assert_int_equal(0, lru->inline_acc_vallen);
+  free(lru);
+}
+
+static void
+test_tmp_pool(void **context)
+{
+  lru_t *lru;
+  cmd_handler cmd;
+  lru_val_t lru_val;
+  char key[9], value[16];
+  lru = lru_init(1000, 8, 8);
+
+  cmd.state = ASCII_CMD_READY;
+  cmd.key = key;
+  cmd.req.keylen = 8;
+  cmd.req.cas = 0;
+  cmd.value = value;
+  cmd.value_stored = 16;
+  memset(value, 'v', 16);
+
+  // More updates in flight than a single tmp bucket shard holds
+  for (int i = 0; i < 500; i++)
+    {
+      snprintf(key, sizeof(key), "key%05d", i % 100);
+      cmd.req.op = PROTOCOL_BINARY_CMD_SET;
+      value[0] = i;
+      assert_true(lru_upsert(lru, &cmd, &lru_val));
+    }
+  for (int i = 400; i < 500; i++)
+    {
+      snprintf(key, sizeof(key), "key%05d", i % 100);
+      cmd.req.op = PROTOCOL_BINARY_CMD_GET;
+      value[0] = i;
+      assert_true(lru_get(lru, &cmd, &lru_val));
+      assert_int_equal(16, lru_val.vallen);
+      assert_memory_equal(value, lru_val.value, 16);
+    }
+  assert_int_equal(100, lru->objcnt);
+  assert_int_equal(100, lru->ninline_valcnt);
+
+  lru_cleanup(lru);
+  assert_int_equal(0, lru->objcnt);
+  assert_int_equal(0, lru->ninline_valcnt);
+  free(lru);
+}
+
+static void
+test_resize(void **context)
+{
+  lru_t *lru;
+  cmd_handler cmd;
+  lru_val_t lru_val;
+  char key[9], value[16];
+  uint64_t capacity;
+  lru = lru_init(100, 8, 8);
+
+  cmd.state = ASCII_CMD_READY;
+  cmd.key = key;
+  cmd.req.keylen = 8;
+  cmd.req.cas = 0;
+  cmd.value = value;
+  cmd.value_stored = 16;
+  memset(value, 'v', 16);
+
+  for (int i = 0; i < 60; i++)
+    {
+      snprintf(key, sizeof(key), "key%05d", i);
+      cmd.req.op = PROTOCOL_BINARY_CMD_SET;
+      value[0] = i;
+      assert_true(lru_upsert(lru, &cmd, &lru_val));
+    }
+
+  // Too small for the items
+  capacity = lru_capacity(lru);
+  assert_false(lru_resize(lru, 10));
+  assert_true(lru_resize(lru, 1000));
+  assert_false(lru_resize(lru, 2000));
+  assert_true(lru_capacity(lru) > capacity);
+
+  // Items are found and updated half way through the migration
+  assert_false(lru_migrate(lru, 20));
+  lru_resize_end(lru);
+  assert_false(lru_migrate(lru, 0));
+  for (int i = 0; i < 60; i++)
+    {
+      snprintf(key, sizeof(key), "key%05d", i);
+      value[0] = i;
+      cmd.req.op = PROTOCOL_BINARY_CMD_GET;
+      assert_true(lru_get(lru, &cmd, &lru_val));
+      assert_memory_equal(value, lru_val.value, 16);
+      if (i % 3 == 0)
+        {
+          cmd.req.op = PROTOCOL_BINARY_CMD_SET;
+          value[0] = i + 100;
+          assert_true(lru_upsert(lru, &cmd, &lru_val));
+        }
+      else if (i % 3 == 1)
+        lru_delete(lru, &cmd);
+    }
+  for (int i = 60; i < 200; i++)
+    {
+      snprintf(key, sizeof(key), "key%05d", i);
+      cmd.req.op = PROTOCOL_BINARY_CMD_SET;
+      value[0] = i;
+      assert_true(lru_upsert(lru, &cmd, &lru_val));
+    }
+
+  while (!lru_migrate(lru, 20))
+    ;
+  lru_resize_end(lru);
+  assert_true(lru_migrate(lru, 0));
+
+  for (int i = 0; i < 200; i++)
+    {
+      snprintf(key, sizeof(key), "key%05d", i);
+      value[0] = i < 60 && i % 3 == 0 ? i + 100 : i;
+      cmd.req.op = PROTOCOL_BINARY_CMD_GET;
+      if (i < 60 && i % 3 == 1)
+        {
+          assert_false(lru_get(lru, &cmd, &lru_val));
+          continue;
+        }
+      assert_true(lru_get(lru, &cmd, &lru_val));
+      assert_memory_equal(value, lru_val.value, 16);
+    }
+  assert_int_equal(180, lru->objcnt);
+  assert_int_equal(180, lru->ninline_valcnt);
+
+  lru_cleanup(lru);
+  assert_int_equal(0, lru->objcnt);
+  assert_int_equal(0, lru->ninline_valcnt);
+  assert_int_equal(0, lru->deferred_cnt);
+  free(lru);
+}
+
+static void
+test_mem_limit(void **context)
+{
+  lru_t *lru;
+  swiper_t *swiper;
+  cmd_handler cmd;
+  lru_val_t lru_val;
+  char key[9], value[1000];
+  uint64_t table_mem;
+  lru = lru_init(1000, 8, 8);
+  swiper = swiper_init(lru);
+  table_mem = lru_mem_used(lru);
+  lru->mem_limit = table_mem + 100 * 1000;
+
+  cmd.state = ASCII_CMD_READY;
+  cmd.key = key;
+  cmd.req.keylen = 8;
+  cmd.req.cas = 0;
+  cmd.req.op = PROTOCOL_BINARY_CMD_SET;
+  cmd.value = value;
+  cmd.value_stored = 1000;
+  cmd.extra.twoval.expiration = 900;
+  memset(value, 'v', 1000);
+
+  // Far below the object count threshold, but above the memory limit
+  for (int i = 0; i < 150; i++)
+    {
+      snprintf(key, sizeof(key), "key%05d", i);
+      assert_true(lru_upsert(lru, &cmd, &lru_val));
+    }
+  // Values count by the slot of their class
+  assert_int_equal(table_mem + 150 * LRU_VAL_CLASS_SIZE(2),
+                   lru_mem_used(lru));
+
+  lru_swipe(swiper);
+  assert_true(lru_mem_used(lru) <= LRU_MEM_LOW_WATER(lru->mem_limit));
+  assert_int_equal(swiper->evicted, 150 - lru->objcnt);
+  // the least recently updated ones are gone
+  cmd.req.op = PROTOCOL_BINARY_CMD_GET;
+  snprintf(key, sizeof(key), "key%05d", 0);
+  assert_false(lru_get(lru, &cmd, &lru_val));
+  snprintf(key, sizeof(key), "key%05d", 149);
+  assert_true(lru_get(lru, &cmd, &lru_val));
+
+  // A larger table would not fit next to the items
+  assert_false(lru_resize(lru, 2000));
+
+  lru_cleanup(lru);
+  assert_int_equal(0, lru->objcnt);
+  assert_int_equal(0, lru->ninline_vallen);
+  assert_int_equal(0, lru->out_bytes);
+  free(lru);
+  free(swiper);
+}
+
+static void
+test_mem_limit_inline(void **context)
+{
+  lru_t *lru;
+  swiper_t *swiper;
+  cmd_handler cmd;
+  lru_val_t lru_val;
+  char key[9], value[40];
+  int found;
+  lru = lru_init(1000, 8, 8);
+  swiper = swiper_init(lru);
+  // The table alone is above the low water mark
+  lru->mem_limit = lru_mem_used(lru) + 500;
+
+  cmd.state = ASCII_CMD_READY;
+  cmd.key = key;
+  cmd.req.keylen = 8;
+  cmd.req.cas = 0;
+  cmd.req.op = PROTOCOL_BINARY_CMD_SET;
+  cmd.value = value;
+  cmd.extra.twoval.expiration = 900;
+  memset(value, 'v', sizeof(value));
+
+  // A few old items out of line, many newer ones inline
+  cmd.value_stored = sizeof(value);
+  for (int i = 0; i < 20; i++)
+    {
+      snprintf(key, sizeof(key), "old%05d", i);
+      assert_true(lru_upsert(lru, &cmd, &lru_val));
+    }
+  cmd.value_stored = 8;
+  for (int i = 0; i < 200; i++)
+    {
+      snprintf(key, sizeof(key), "new%05d", i);
+      assert_true(lru_upsert(lru, &cmd, &lru_val));
+    }
+  assert_true(lru_mem_used(lru) > lru->mem_limit);
+
+  // Evicting the inline items frees nothing, the swipe stops once the
+  // out of line bytes are gone rather than empty the table.
+  lru_swipe(swiper);
+  assert_int_equal(0, lru->ninline_vallen);
+  assert_int_equal(20, swiper->evicted);
+  assert_int_equal(200, lru->objcnt);
+  cmd.req.op = PROTOCOL_BINARY_CMD_GET;
+  found = 0;
+  for (int i = 0; i < 200; i++)
+    {
+      snprintf(key, sizeof(key), "new%05d", i);
+      found += lru_get(lru, &cmd, &lru_val);
+    }
+  assert_int_equal(200, found);
+
+  lru_cleanup(lru);
+  free(lru);
+  free(swiper);
+}
+
+static void
+test_txid_ranges(void **context)
+{
+  lru_t *lru[2];
+  cmd_handler cmd;
+  lru_val_t lru_val;
+  uint64_t cas[2] = { 0, 0 };
+  lru[0] = lru_init(100, 8, 8);
+  lru[1] = lru_init(100, 8, 8);
+
+  cmd.state = ASCII_CMD_READY;
+  memcpy(&cmd.buffer, "abc", 3);
+  cmd.key = &cmd.buffer[0];
+  cmd.buf_used = 3;
+  cmd.req.keylen = 3;
+  cmd.req.cas = 0;
+  cmd.value = "abc";
+  cmd.value_stored = 3;
+
+  // A range reserved from one table is never used for the other
+  for (int i = 0; i < 2 * LRU_TXID_BATCH; i++)
+    for (int j = 0; j < 2; j++)
+      {
+        cmd.req.op = PROTOCOL_BINARY_CMD_SET;
+        assert_true(lru_upsert(lru[j], &cmd, &lru_val));
+        cmd.req.op = PROTOCOL_BINARY_CMD_GET;
+        assert_true(lru_get(lru[j], &cmd, &lru_val));
+        assert_true(lru_val.cas > cas[j]);
+        assert_true(lru_val.cas < lru[j]->txid);
+        cas[j] = lru_val.cas;
+      }
+
+  // Within a table txids are consecutive until the range runs out
+  for (int i = 0; i < LRU_TXID_BATCH; i++)
+    {
+      cmd.req.op = PROTOCOL_BINARY_CMD_SET;
+      assert_true(lru_upsert(lru[0], &cmd, &lru_val));
+      cmd.req.op = PROTOCOL_BINARY_CMD_GET;
+      assert_true(lru_get(lru[0], &cmd, &lru_val));
+      if (i)
+        assert_int_equal(cas[0] + 1, lru_val.cas);
+      cas[0] = lru_val.cas;
+    }
+  for (int j = 0; j < 2; j++)
+    {
+      lru_cleanup(lru[j]);
+      free(lru[j]);
+    }
+}
+
+static void
+test_touch_window(void **context)
+{
+  lru_t *lru;
+  swiper_t *swiper;
+  cmd_handler cmd;
+  lru_val_t lru_val;
+  lru = lru_init(70, 8, 8);
+  swiper = swiper_init(lru);
+
+  cmd.state = ASCII_CMD_READY;
+  cmd.key = &cmd.buffer[0];
+  cmd.buf_used = 3;
+  cmd.req.keylen = 3;
+  cmd.req.cas = 0;
+  cmd.value_stored = 0;
+  cmd.extra.twoval.expiration = 900;
+
+  // Hits right after the write leave the recency alone
+  cmd.req.op = PROTOCOL_BINARY_CMD_SET;
+  sprintf(&cmd.buffer[0], "%03d", 0);
+  assert_true(lru_upsert(lru, &cmd, &lru_val));
+  cmd.req.op = PROTOCOL_BINARY_CMD_GET;
+  for (int i = 0; i < LRU_TXID_BATCH; i++)
+    assert_true(lru_get(lru, &cmd, &lru_val));
+  assert_int_equal(LRU_TXID_BATCH, lru->touch_skipped);
+
+  // Outside of the window a hit still saves the key from eviction
+  lru->touch_window = 0;
+  for (int i = 1; i < 120; i++)
+    {
+      sprintf(&cmd.buffer[0], "%03d", i);
+      cmd.req.op = PROTOCOL_BINARY_CMD_SET;
+      lru_upsert(lru, &cmd, &lru_val);
+      if (i % 10 == 0)
+        {
+          sprintf(&cmd.buffer[0], "%03d", 0);
+          cmd.req.op = PROTOCOL_BINARY_CMD_GET;
+          assert_true(lru_get(lru, &cmd, &lru_val));
+        }
+    }
+  lru_swipe(swiper);
+  assert_int_not_equal(0, swiper->evicted);
+  sprintf(&cmd.buffer[0], "%03d", 0);
+  cmd.req.op = PROTOCOL_BINARY_CMD_GET;
+  assert_true(lru_get(lru, &cmd, &lru_val));
+  sprintf(&cmd.buffer[0], "%03d", 1);
+  assert_false(lru_get(lru, &cmd, &lru_val));
+
+  lru_cleanup(lru);
+  free(lru);
+  free(swiper);
+}
+
+static void
+test_swipe_sample(void **context)
+{
+  lru_t *lru;
+  swiper_t *swiper;
+  cmd_handler cmd;
+  lru_val_t lru_val;
+  uint64_t threshold;
+  int found;
+  lru = lru_init(700, 8, 8);
+  swiper = swiper_init(lru);
+  swiper->policy = SWIPE_SAMPLE;
+  threshold = LRU_SWIPE_THRESHOLD(lru_capacity(lru));
+
+  cmd.state = ASCII_CMD_READY;
+  cmd.key = &cmd.buffer[0];
+  cmd.buf_used = 4;
+  cmd.req.keylen = 4;
+  cmd.req.cas = 0;
+  cmd.req.op = PROTOCOL_BINARY_CMD_SET;
+  cmd.value_stored = 0;
+  cmd.extra.twoval.expiration = 900;
+
+  for (int i = 0; i < 850; i++)
+    {
+      sprintf(&cmd.buffer[0], "%04d", i);
+      lru_upsert(lru, &cmd, &lru_val);
+    }
+  assert_true(lru->objcnt > threshold);
+
+  // Eviction stops at the threshold and mostly hits the oldest items
+  lru_swipe(swiper);
+  assert_int_equal(threshold, lru->objcnt);
+  assert_int_equal(0, swiper->expired);
+  cmd.req.op = PROTOCOL_BINARY_CMD_GET;
+  found = 0;
+  for (int i = 0; i < 100; i++)
+    {
+      sprintf(&cmd.buffer[0], "%04d", i);
+      found += lru_get(lru, &cmd, &lru_val);
+    }
+  assert_true(found < 50);
+
+  lru_cleanup(lru);
+  free(lru);
+
+  // Without pressure expired items are still found
+  lru = lru_init(700, 8, 8);
+  swiper->lru = lru;
+  cmd.req.op = PROTOCOL_BINARY_CMD_SET;
+  cmd.extra.twoval.expiration = 1;
+  for (int i = 0; i < 500; i++)
+    {
+      sprintf(&cmd.buffer[0], "%04d", i);
+      lru_upsert(lru, &cmd, &lru_val);
+    }
+  clock_pass(2);
+  lru_swipe(swiper);
+  assert_int_equal(0, swiper->evicted);
+  assert_true(swiper->expired > 0);
+  assert_int_equal(500 - swiper->expired, lru->objcnt);
+
+  lru_cleanup(lru);
+  free(lru);
+  free(swiper);
+}
+
+static void
+test_swipe_step(void **context)
+{
+  lru_t *lru;
+  swiper_t *swiper;
+  cmd_handler cmd;
+  lru_val_t lru_val;
+  uint64_t capacity, steps;
+  lru = lru_init(70, 8, 8);
+  swiper = swiper_init(lru);
+  capacity = lru_capacity(lru);
+
+  cmd.state = ASCII_CMD_READY;
+  cmd.req.op = PROTOCOL_BINARY_CMD_SET;
+  cmd.key = &cmd.buffer[0];
+  cmd.buf_used = 3;
+  cmd.req.keylen = 3;
+  cmd.req.cas = 0;
+  cmd.value_stored = 0;
+  cmd.extra.twoval.expiration = 900;
+  for (int i = 0; i < 120; i++)
+    {
+      sprintf(&cmd.buffer[0], "%03d", i);
+      lru_upsert(lru, &cmd, &lru_val);
+    }
+
+  // Nothing is evicted before the first pass reaches the end of the
+  // table, the second pass evicts.
+  for (steps = 1; !lru_swipe_step(swiper, 10, 0); steps++)
+    {
+      assert_true(swiper->resume);
+      if (swiper->evicting)
+        continue;
+      assert_int_equal(steps * 10, swiper->cursor);
+      assert_int_equal(0, swiper->evicted);
+    }
+  assert_true(swiper->evicting);
+  assert_int_equal((capacity * 2 + 9) / 10, steps);
+  assert_false(swiper->resume);
+  assert_int_not_equal(0, swiper->evicted);
+  assert_int_equal(LRU_SWIPE_THRESHOLD(capacity), lru->objcnt);
+  for (int i = 0; i < 10; i++)
+    {
+      sprintf(&cmd.buffer[0], "%03d", i);
+      assert_false(lru_get(lru, &cmd, &lru_val));
+    }
+
+  // A time bound alone completes a pass of a small table
+  assert_true(lru_swipe_step(swiper, 0, 1000000));
+
+  lru_cleanup(lru);
+  free(lru);
+  free(swiper);
+}
+
+static void
+test_swipe_parallel(void **context)
+{
+  lru_t *lru;
+  swiper_t *swipers[3];
+  cmd_handler cmd;
+  lru_val_t lru_val;
+  uint64_t capacity, scanned;
+  bool done;
+  lru = lru_init(70, 8, 8);
+  capacity = lru_capacity(lru);
+  for (int i = 0; i < 3; i++)
+    {
+      swipers[i] = swiper_init(lru);
+      swipers[i]->part = i;
+      swipers[i]->nparts = 3;
+    }
+
+  cmd.state = ASCII_CMD_READY;
+  cmd.req.op = PROTOCOL_BINARY_CMD_SET;
+  cmd.key = &cmd.buffer[0];
+  cmd.buf_used = 3;
+  cmd.req.keylen = 3;
+  cmd.req.cas = 0;
+  cmd.value_stored = 0;
+  cmd.extra.twoval.expiration = 900;
+  for (int i = 0; i < 80; i++)
+    {
+      sprintf(&cmd.buffer[0], "%03d", i);
+      assert_true(lru_upsert(lru, &cmd, &lru_val));
+    }
+
+  // The parts cover the table without overlap
+  scanned = 0;
+  for (int i = 0; i < 3; i++)
+    {
+      assert_false(lru_swipe_collect(swipers[i], 1, 0));
+      assert_int_equal(capacity * i / 3 + 1, swipers[i]->cursor);
+      while (!lru_swipe_collect(swipers[i], 1, 0))
+        ;
+      assert_int_equal(capacity * (i + 1) / 3, swipers[i]->cursor);
+      for (int idx = 0; idx < LRU_HIST_SIZE; idx++)
+        scanned += swipers[i]->hist[idx];
+      assert_int_equal(0, swipers[i]->evicted);
+    }
+  assert_int_equal(lru->objcnt, scanned);
+
+  // Eviction picks the oldest items over all the parts
+  assert_false(lru_swipe_merge(swipers, 3));
+  for (int i = 0; i < 3; i++)
+    {
+      assert_true(swipers[i]->evicting);
+      assert_int_equal(swipers[0]->cutoff, swipers[i]->cutoff);
+      while (!lru_swipe_collect(swipers[i], 1, 0))
+        ;
+    }
+  done = lru_swipe_merge(swipers, 3);
+  assert_true(done);
+  assert_false(swipers[0]->resume);
+  assert_int_equal(LRU_SWIPE_THRESHOLD(capacity), lru->objcnt);
+  assert_int_equal(scanned - lru->objcnt, swipers[0]->evicted);
+  for (int i = 0; i < 80 - LRU_SWIPE_THRESHOLD(capacity); i++)
+    {
+      sprintf(&cmd.buffer[0], "%03d", i);
+      assert_false(lru_get(lru, &cmd, &lru_val));
+    }
+  sprintf(&cmd.buffer[0], "%03d", 79);
+  assert_true(lru_get(lru, &cmd, &lru_val));
+
+  lru_cleanup(lru);
+  free(lru);
+  for (int i = 0; i < 3; i++)
+    free(swipers[i]);
+}
+
+int
+main(void)
+{
+  const struct CMUnitTest lru_tests[] = {
+    cmocka_unit_test(test_init_cleanup),
+    cmocka_unit_test(test_insert_update),
+    cmocka_unit_test(test_numeric_val),
+    cmocka_unit_test(test_add_replace),
+    cmocka_unit_test(test_append_prepend),
+    cmocka_unit_test(test_numeric_append_prepend),
+    cmocka_unit_test(test_lru_full),
+    cmocka_unit_test(test_lru_delete),
+    cmocka_unit_test(test_table_pages),
+    cmocka_unit_test(test_numa),
+    cmocka_unit_test(test_tags),
+    cmocka_unit_test(test_compact),
+    cmocka_unit_test(test_value_classes),
+    cmocka_unit_test(test_upsert_enomem),
+    cmocka_unit_test(test_swiper_cutoff),
+    cmocka_unit_test(test_swiper_epoch),
+    cmocka_unit_test(test_swiper_txid),
+    cmocka_unit_test(test_touch),
+    cmocka_unit_test(test_update_delete_deferred),
+    cmocka_unit_test(test_inplace_update),
+    cmocka_unit_test(test_tmp_pool),
+    cmocka_unit_test(test_resize),
+    cmocka_unit_test(test_mem_limit),
+    cmocka_unit_test(test_mem_limit_inline),
+    cmocka_unit_test(test_txid_ranges),
+    cmocka_unit_test(test_touch_window),
+    cmocka_unit_test(test_swipe_sample),
+    cmocka_unit_test(test_swipe_step),
+    cmocka_unit_test(test_swipe_parallel),
+  };
+  int ret;
+
+  atomic_store_explicit(&clock_secs, clock_read(), memory_order_relaxed);
+  rcu_register_thread();
+  ret = cmocka_run_group_tests(lru_tests, NULL, NULL);
+  rcu_unregister_thread();
+  return ret;
 }
@@ -21,16 +21,27 @@
 #include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <linux/filter.h>
 #include <netinet/in.h>
 #include <pthread.h>
+#include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
 #include <sys/poll.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
 #include <syslog.h>
+#include <time.h>
 #include <unistd.h>
+#include <urcu-qsbr.h>
 
+#ifdef HAVE_LIBURING_H
+#include <liburing.h>
+#endif
+
+#include "clock.h"
 #include "cmd_parser.h"
 #include "cmd_reader.h"
 #include "lru.h"
@@ -38,156 +49,939 @@
 
 #define BUF_SIZE 65536
 #define POLL_TIMEOUT 1000
+#define EPOLL_EVENTS_MAX 256
+#define CONN_TABLE_INIT_SIZE 256
+// Bounds of the interval between two swipes, in milliseconds.
+#define SWIPE_INTERVAL_MIN 10
+#define SWIPE_INTERVAL_MAX 1000
+// A swipe runs in steps of at most this many microseconds, with
+// SWIPE_INTERVAL_MIN between them.
+#define SWIPE_STEP_USEC 2000
+// Buckets of the old table the swiper moves per interval during a resize.
+#define SWIPE_MIGRATE_STEP 65536
 
 static int port_num = 7500;
-// TODO different system has different max value.
-static int poll_fd_max = 256;
+static bool reuseport = false;
+#ifdef HAVE_LIBURING_H
+static bool uring_sqpoll = false;
+#endif
 static lru_t *lru;
 static swiper_t *swiper;
+// A scan is split over swipe_threads threads, swipe_parts[0] is swiper
+static int swipe_threads = 1;
+static swiper_t **swipe_parts;
+static pthread_barrier_t swipe_barrier;
+static int swiper_cpu = -1;
+static uint64_t num_objects = 1 << 25;
+// The table is doubled until it holds this many objects
+static uint64_t max_objects = 0;
+static uint64_t mem_limit = 0;
+static uint64_t touch_window = LRU_TOUCH_WINDOW;
+// Every bucket has room for keys and values up to these sizes. Larger
+// keys are stored in slab chunks, larger values in a slot of their value
+// class, see LRU_VAL_CLASSES.
+static size_t inline_keylen = 20;
+static size_t inline_vallen = 32;
+// Threads faulting in the table at startup, 0 to leave it to the writes
+static int prefault_threads = 0;
+// Worker thread i runs on the i-th cpu the process may run on
+static bool pin_threads = false;
+static enum swipe_policy swipe_policy = SWIPE_SCAN;
+// Expiration reads the seconds a timer thread keeps, see clock.h
+static bool clock_cached = true;
 
 struct thread_pipe
 {
   int thread_id;
+  // Only one of them is used. With SO_REUSEPORT each thread accepts on
+  // its own listen_fd, otherwise main forwards accepted fds via pipefd.
   int pipefd[2];
+  int listen_fd;
+};
+
+struct conn
+{
+  cmd_handler cmd;
+  ed_writer writer;
+  // Reading is paused while more than WRITER_HIGH_WATER bytes of output
+  // are pending, and resumed once they drain below WRITER_LOW_WATER.
+  bool read_paused;
+  // EPOLLOUT is part of the registered events.
+  bool out_armed;
+  // Used by the io_uring backend only. Number of sends in flight, whether
+  // a multishot recv is armed, and whether the fd is being shut down.
+  int sends;
+  bool recv_armed;
+  bool closing;
+  // Bumped whenever the fd is handed out again, part of the user_data of
+  // every request so that a stale completion or cancel cannot hit the
+  // connection that reuses the fd number.
+  uint32_t gen;
+};
+
+// Connections owned by a single ev_loop thread, indexed by fd. Only the
+// pointer array is reallocated on growth: cmd_handler keeps pointers
+// into its own buffer, so a connection must never move. Slots of closed
+// fds are reused by the next fd the kernel hands out with that number.
+struct conn_table
+{
+  struct conn **conns;
+  int size;
 };
 
+static struct conn *
+conn_table_get(struct conn_table *table, int fd)
+{
+  int new_size;
+  struct conn **conns;
+
+  if (fd >= table->size)
+    {
+      new_size = table->size ? table->size : CONN_TABLE_INIT_SIZE;
+      while (new_size <= fd)
+        new_size *= 2;
+      conns = realloc(table->conns, sizeof(struct conn *) * new_size);
+      if (!conns)
+        return NULL;
+      memset(&conns[table->size], 0x00,
+             sizeof(struct conn *) * (new_size - table->size));
+      table->conns = conns;
+      table->size = new_size;
+    }
+  if (!table->conns[fd])
+    table->conns[fd] = calloc(1, sizeof(struct conn));
+  return table->conns[fd];
+}
+
+static void
+conn_close(struct conn *conn, int fd, int thread_id)
+{
+  // The slot stays in the table for the next fd with that number, only
+  // its output buffers are released.
+  writer_free(&conn->writer);
+  conn->read_paused = false;
+  conn->out_armed = false;
+  // Closing the fd also removes it from the epoll interest list.
+  close(fd);
+  syslog(LOG_DEBUG, "connection fd %d closed in thread %d", fd, thread_id);
+}
+
+static bool
+conn_read(struct conn *conn, int fd, char *buffer)
+{
+  ssize_t rc;
+  bool close_fd = false;
+
+  // Edge triggered: drain the socket until it would block, otherwise
+  // we never get notified for the remaining bytes. The exception is a
+  // client that does not read its responses; we stop reading from it
+  // and leave the rest in the socket until its output drains.
+  while (true)
+    {
+      if (writer_pending(&conn->writer) > WRITER_HIGH_WATER)
+        {
+          conn->read_paused = true;
+          break;
+        }
+      rc = recv(fd, buffer, BUF_SIZE, 0);
+      if (rc > 0)
+        {
+          edamame_read(lru, &conn->cmd, rc, buffer, &conn->writer,
+                       &close_fd);
+          if (close_fd)
+            break;
+          continue;
+        }
+      if (rc < 0 && errno == EINTR)
+        continue;
+      if (rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        break;
+      close_fd = true;
+      break;
+    }
+  return !close_fd;
+}
+
+static void
+conn_event(struct conn *conn, int epfd, int fd, uint32_t events,
+           char *buffer, int thread_id)
+{
+  struct epoll_event ev;
+  bool readable, want_out;
+
+  readable = !conn->read_paused
+             && (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR));
+  if (conn->read_paused && (events & EPOLLOUT))
+    {
+      if (!writer_flush(&conn->writer, fd))
+        goto close;
+      // Resume reading, there won't be another edge for the bytes
+      // already queued in the socket.
+      if (writer_pending(&conn->writer) < WRITER_LOW_WATER)
+        readable = true;
+    }
+  if (readable)
+    {
+      conn->read_paused = false;
+      if (!conn_read(conn, fd, buffer))
+        {
+          writer_flush(&conn->writer, fd);
+          goto close;
+        }
+    }
+  if (!writer_flush(&conn->writer, fd))
+    goto close;
+
+  // Only ask for writability while there is output left.
+  want_out = writer_pending(&conn->writer) > 0;
+  if (want_out != conn->out_armed)
+    {
+      ev.events = EPOLLIN | EPOLLRDHUP | EPOLLET | (want_out ? EPOLLOUT : 0);
+      ev.data.fd = fd;
+      if (epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev))
+        {
+          syslog(LOG_ERR, "epoll_ctl mod fd %d failed: %s", fd,
+                 strerror(errno));
+          goto close;
+        }
+      conn->out_armed = want_out;
+    }
+  return;
+close:
+  conn_close(conn, fd, thread_id);
+}
+
+static void
+conn_open(struct conn_table *table, int epfd, int fd)
+{
+  struct conn *conn;
+  struct epoll_event ev;
+
+  conn = conn_table_get(table, fd);
+  if (!conn)
+    {
+      syslog(LOG_ERR, "cannot grow connection table to %d", fd);
+      close(fd);
+      return;
+    }
+  reset_cmd_handler(&conn->cmd);
+  writer_init(&conn->writer, WRITER_DEFAULT_SIZE);
+  conn->read_paused = false;
+  conn->out_armed = false;
+  ev.events = EPOLLIN | EPOLLRDHUP | EPOLLET;
+  ev.data.fd = fd;
+  if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev))
+    {
+      syslog(LOG_ERR, "epoll_ctl add fd %d failed: %s", fd, strerror(errno));
+      close(fd);
+    }
+}
+
+// Accept on the edge triggered listen_fd until the backlog is empty, there
+// is no new edge for the connections left in it. A connection that went
+// away before it was accepted is skipped. Out of fds, the listener is
+// re-armed so that epoll_wait reports the clients still queued again.
+static void
+accept_all(struct thread_pipe *tp, struct conn_table *table, int epfd)
+{
+  struct epoll_event ev;
+  int fd, err;
+
+  while (1)
+    {
+      fd = accept4(tp->listen_fd, NULL, NULL, SOCK_NONBLOCK);
+      if (fd >= 0)
+        {
+          conn_open(table, epfd, fd);
+          continue;
+        }
+      err = errno;
+      if (err == EINTR || err == ECONNABORTED || err == EPROTO)
+        continue;
+      if (err == EAGAIN || err == EWOULDBLOCK)
+        return;
+      syslog(LOG_ERR, "Accept failed in thread %d: %s", tp->thread_id,
+             strerror(err));
+      if (err == EMFILE || err == ENFILE)
+        {
+          ev.events = EPOLLIN | EPOLLET;
+          ev.data.fd = tp->listen_fd;
+          if (epoll_ctl(epfd, EPOLL_CTL_MOD, tp->listen_fd, &ev))
+            syslog(LOG_ERR, "epoll_ctl mod listen fd failed: %s",
+                   strerror(errno));
+        }
+      return;
+    }
+}
+
 void *
 ev_loop(void *context)
 {
   struct thread_pipe *tp = (struct thread_pipe *)context;
   int fdbuf[256];
-  int rc, poll_fd_num, poll_fd_cnum, fdbuf_num;
-  struct pollfd *clientfds = calloc(sizeof(struct pollfd), poll_fd_max);
-  cmd_handler *cmds = calloc(sizeof(cmd_handler), poll_fd_max);
-  ed_writer *writers = calloc(sizeof(ed_writer), poll_fd_max);
+  int epfd, rc, fd, fdbuf_num;
+  struct epoll_event ev, events[EPOLL_EVENTS_MAX];
+  struct conn_table table = { 0 };
   char buffer[BUF_SIZE];
 
-  clientfds[0].fd = tp->pipefd[0];
-  clientfds[0].events = POLLIN;
-  for (int i = 1; i < poll_fd_max; i++)
+  epfd = epoll_create1(EPOLL_CLOEXEC);
+  if (epfd < 0)
+    {
+      syslog(LOG_ERR, "epoll_create1 failed in thread %d: %s",
+             tp->thread_id, strerror(errno));
+      return NULL;
+    }
+  ev.events = EPOLLIN;
+  if (reuseport)
     {
-      clientfds[i].fd = -1;
+      // Edge triggered as well, accept until EAGAIN.
+      ev.events |= EPOLLET;
+      ev.data.fd = tp->listen_fd;
+    }
+  else
+    ev.data.fd = tp->pipefd[0];
+  if (epoll_ctl(epfd, EPOLL_CTL_ADD, ev.data.fd, &ev))
+    {
+      syslog(LOG_ERR, "epoll_ctl failed in thread %d: %s", tp->thread_id,
+             strerror(errno));
+      return NULL;
     }
-  poll_fd_num = 1;
 
+  rcu_register_thread();
   syslog(LOG_INFO, "init thread %d", tp->thread_id);
 
   while (1)
     {
-      rc = poll(clientfds, poll_fd_num, POLL_TIMEOUT);
+      // No lru item is referenced across iterations, which makes the
+      // loop boundary a quiescent state. Block offline so that an idle
+      // thread does not hold up grace periods.
+      rcu_quiescent_state();
+      rc = epoll_wait(epfd, events, EPOLL_EVENTS_MAX, 0);
+      if (rc == 0)
+        {
+          rcu_thread_offline();
+          rc = epoll_wait(epfd, events, EPOLL_EVENTS_MAX, POLL_TIMEOUT);
+          rcu_thread_online();
+        }
       if (rc < 0)
         {
-          syslog(LOG_ERR, "poll error: %s", strerror(errno));
+          if (errno != EINTR)
+            syslog(LOG_ERR, "epoll_wait error: %s", strerror(errno));
           continue;
         }
-      if (rc == 0)
-        continue;
-      poll_fd_cnum = poll_fd_num;
 
-      // First, check for accept
-      if (clientfds[0].revents & POLLIN)
+      for (int i = 0; i < rc; i++)
         {
-          syslog(LOG_DEBUG, "accepting fd in thread %d", tp->thread_id);
-          rc = read(clientfds[0].fd, fdbuf, sizeof(fdbuf));
-          fdbuf_num = rc / sizeof(int);
-          int j = 1;
-          for (int i = 0; i < fdbuf_num; i++)
+          fd = events[i].data.fd;
+          if (reuseport && fd == tp->listen_fd)
             {
-              while (j < poll_fd_max && clientfds[j].fd >= 0)
-                j++;
-              // TODO j might overflow
-              clientfds[j].fd = fdbuf[i];
-              clientfds[j].events = POLLIN;
-              reset_cmd_handler(&cmds[j]);
-              writer_init(&writers[j], WRITER_DEFAULT_SIZE);
-              if (j >= poll_fd_num)
-                poll_fd_num = j + 1;
+              accept_all(tp, &table, epfd);
+              continue;
             }
-        }
-
-      // Read/Write from rest of fds
-      for (int i = 1; i < poll_fd_cnum; i++)
-        {
-          if (clientfds[i].fd < 0)
-            continue;
-          if (!(clientfds[i].revents & POLLIN))
-            continue;
-          bool close_fd = false;
-          rc = recv(clientfds[i].fd, buffer, sizeof(buffer), 0);
-          if (rc > 0)
+          if (!reuseport && fd == tp->pipefd[0])
             {
-              edamame_read(lru, &cmds[i], rc, buffer, &writers[i], &close_fd);
-              writer_flush(&writers[i], clientfds[i].fd);
+              syslog(LOG_DEBUG, "accepting fd in thread %d", tp->thread_id);
+              fdbuf_num = read(fd, fdbuf, sizeof(fdbuf)) / (int)sizeof(int);
+              for (int j = 0; j < fdbuf_num; j++)
+                conn_open(&table, epfd, fdbuf[j]);
+              continue;
             }
-          if (rc <= 0 || close_fd)
-            {
-              // We only read once per poll per fd, so we should not see
-              // EWOULDBLOCK here.
-              // This load balances each handle, but performance may suffer
-              // from poll implementation. More poll system calls in this case.
-              close(clientfds[i].fd);
-              clientfds[i].fd = -1;
-              syslog(LOG_DEBUG, "connection fd %d closed in thread %d", i,
+          conn_event(table.conns[fd], epfd, fd, events[i].events, buffer,
                      tp->thread_id);
-              if (i == poll_fd_num - 1)
-                {
-                  for (int j = i; j > 0; j--)
-                    {
-                      if (clientfds[j].fd >= 0)
-                        {
-                          poll_fd_num = j + 1;
-                          break;
-                        }
-                    }
-                }
-            }
         }
     }
+  rcu_unregister_thread();
   return NULL;
 }
 
-int
-main(int argc, char **argv)
+#ifdef HAVE_LIBURING_H
+#define URING_ENTRIES 4096
+#define URING_BUF_GROUP 0
+// Must be a power of two.
+#define URING_BUF_COUNT 1024
+#define URING_BUF_SIZE 16384
+#define URING_SEND_MAX 16
+
+enum uring_op
 {
-  int c, num_threads = 1;
-  struct sockaddr_in addr;
-  const int on = 1;
-  int listen_fd, rc, round_robin = 0;
-  struct pollfd listen_poll[1];
+  URING_ACCEPT = 0,
+  URING_PIPE = 1,
+  URING_RECV = 2,
+  URING_SEND = 3,
+  URING_CANCEL = 4,
+};
+
+// user_data of a request: 24 bits of connection generation, 32 bits of
+// fd and 8 bits of uring_op.
+#define URING_GEN_MASK 0xffffff
+#define URING_DATA(op, fd, gen)                                               \
+  (((uint64_t)((gen)&URING_GEN_MASK) << 40) | ((uint64_t)(uint32_t)(fd) << 8) \
+   | (op))
+#define URING_DATA_OP(data) ((data)&0xff)
+#define URING_DATA_FD(data) ((int)(uint32_t)((data) >> 8))
+#define URING_DATA_GEN(data) ((uint32_t)((data) >> 40))
+
+struct uring_ctx
+{
+  struct io_uring ring;
+  struct io_uring_buf_ring *buf_ring;
+  char *bufs;
+  int fdbuf[256];
+};
+
+static struct io_uring_sqe *
+uring_sqe(struct io_uring *ring)
+{
+  struct io_uring_sqe *sqe;
+  // Submission queue is full, flush it to the kernel and retry.
+  while (!(sqe = io_uring_get_sqe(ring)))
+    io_uring_submit(ring);
+  return sqe;
+}
 
-  while ((c = getopt(argc, argv, "t:p:")) != -1)
+static void
+uring_recv(struct uring_ctx *ctx, struct conn *conn, int fd)
+{
+  struct io_uring_sqe *sqe = uring_sqe(&ctx->ring);
+  io_uring_prep_recv_multishot(sqe, fd, NULL, 0, 0);
+  sqe->flags |= IOSQE_BUFFER_SELECT;
+  sqe->buf_group = URING_BUF_GROUP;
+  io_uring_sqe_set_data64(sqe, URING_DATA(URING_RECV, fd, conn->gen));
+  conn->recv_armed = true;
+}
+
+// Send every pending segment of the writer as a chain of linked sends.
+// MSG_WAITALL makes a short send fail the rest of the chain, so segments
+// are never reordered on the wire. A new chain is only started once the
+// previous one has fully completed, from what is left after it.
+static void
+uring_send(struct uring_ctx *ctx, struct conn *conn, int fd)
+{
+  struct io_uring_sqe *sqe;
+  struct iovec iov[URING_SEND_MAX];
+  int iovcnt;
+
+  if (conn->sends || conn->closing)
+    return;
+  iovcnt = writer_iovec(&conn->writer, iov, URING_SEND_MAX);
+  for (int i = 0; i < iovcnt; i++)
     {
-      switch (c)
+      sqe = uring_sqe(&ctx->ring);
+      io_uring_prep_send(sqe, fd, iov[i].iov_base, iov[i].iov_len,
+                         MSG_WAITALL | MSG_NOSIGNAL);
+      if (i + 1 < iovcnt)
+        sqe->flags |= IOSQE_IO_LINK;
+      io_uring_sqe_set_data64(sqe, URING_DATA(URING_SEND, fd, conn->gen));
+      conn->sends++;
+    }
+}
+
+// Shutting down the read side terminates the armed multishot recv while
+// sends in flight may still complete. The fd is closed once no request
+// references it anymore.
+static void
+uring_close(struct conn *conn, int fd, int thread_id)
+{
+  if (!conn->closing)
+    {
+      conn->closing = true;
+      shutdown(fd, SHUT_RD);
+    }
+  if (conn->recv_armed || conn->sends)
+    return;
+  conn->closing = false;
+  conn_close(conn, fd, thread_id);
+}
+
+static void
+uring_open(struct uring_ctx *ctx, struct conn_table *table, int fd)
+{
+  struct conn *conn;
+
+  conn = conn_table_get(table, fd);
+  if (!conn)
+    {
+      syslog(LOG_ERR, "cannot grow connection table to %d", fd);
+      close(fd);
+      return;
+    }
+  reset_cmd_handler(&conn->cmd);
+  writer_init(&conn->writer, WRITER_DEFAULT_SIZE);
+  conn->sends = 0;
+  conn->closing = false;
+  conn->read_paused = false;
+  conn->gen++;
+  uring_recv(ctx, conn, fd);
+}
+
+// Stop reading from a connection whose client does not drain its
+// responses by cancelling the multishot recv. It is re-armed from
+// uring_on_send once the pending output falls below the low water mark.
+static void
+uring_pause_recv(struct uring_ctx *ctx, struct conn *conn, int fd)
+{
+  struct io_uring_sqe *sqe;
+
+  conn->read_paused = true;
+  if (!conn->recv_armed)
+    return;
+  sqe = uring_sqe(&ctx->ring);
+  io_uring_prep_cancel64(sqe, URING_DATA(URING_RECV, fd, conn->gen), 0);
+  io_uring_sqe_set_data64(sqe, URING_DATA(URING_CANCEL, fd, conn->gen));
+}
+
+// The completion belongs to an earlier connection on the same fd. Its
+// provided buffer, if any, still goes back to the ring.
+static bool
+uring_stale(struct uring_ctx *ctx, struct conn_table *table, int fd,
+            uint64_t data, struct io_uring_cqe *cqe)
+{
+  struct conn *conn;
+  unsigned short bid;
+
+  conn = fd < table->size ? table->conns[fd] : NULL;
+  if (conn && URING_DATA_GEN(data) == (conn->gen & URING_GEN_MASK))
+    return false;
+  if (cqe->flags & IORING_CQE_F_BUFFER)
+    {
+      bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+      io_uring_buf_ring_add(ctx->buf_ring,
+                            &ctx->bufs[(size_t)bid * URING_BUF_SIZE],
+                            URING_BUF_SIZE, bid,
+                            io_uring_buf_ring_mask(URING_BUF_COUNT), 0);
+      io_uring_buf_ring_advance(ctx->buf_ring, 1);
+    }
+  syslog(LOG_DEBUG, "stale completion for fd %d", fd);
+  return true;
+}
+
+static void
+uring_on_recv(struct uring_ctx *ctx, struct conn *conn, int fd,
+              struct io_uring_cqe *cqe, int thread_id)
+{
+  unsigned short bid;
+  char *buf;
+  bool close_fd = false;
+
+  if (!(cqe->flags & IORING_CQE_F_MORE))
+    conn->recv_armed = false;
+  if (cqe->res > 0 && (cqe->flags & IORING_CQE_F_BUFFER))
+    {
+      bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+      buf = &ctx->bufs[(size_t)bid * URING_BUF_SIZE];
+      if (!conn->closing)
+        edamame_read(lru, &conn->cmd, cqe->res, buf, &conn->writer,
+                     &close_fd);
+      // hand the buffer back to the kernel
+      io_uring_buf_ring_add(ctx->buf_ring, buf, URING_BUF_SIZE, bid,
+                            io_uring_buf_ring_mask(URING_BUF_COUNT), 0);
+      io_uring_buf_ring_advance(ctx->buf_ring, 1);
+      uring_send(ctx, conn, fd);
+      if (!conn->read_paused
+          && writer_pending(&conn->writer) > WRITER_HIGH_WATER)
+        uring_pause_recv(ctx, conn, fd);
+    }
+  else if (cqe->res != -ENOBUFS && cqe->res != -ECANCELED)
+    close_fd = true;
+
+  if (close_fd || conn->closing)
+    uring_close(conn, fd, thread_id);
+  else if (!conn->recv_armed && !conn->read_paused)
+    uring_recv(ctx, conn, fd);
+}
+
+static void
+uring_on_send(struct uring_ctx *ctx, struct conn *conn, int fd,
+              struct io_uring_cqe *cqe, int thread_id)
+{
+  conn->sends--;
+  // The sends after a short one in the chain are cancelled. Only the
+  // bytes that went out are consumed, the rest is sent again once the
+  // whole chain completed, so a slow reader is held back, not dropped.
+  if (cqe->res >= 0)
+    writer_consume(&conn->writer, cqe->res);
+  else if (cqe->res != -ECANCELED && cqe->res != -EAGAIN
+           && cqe->res != -EINTR)
+    {
+      uring_close(conn, fd, thread_id);
+      return;
+    }
+  if (conn->closing)
+    {
+      uring_close(conn, fd, thread_id);
+      return;
+    }
+  uring_send(ctx, conn, fd);
+  if (conn->read_paused
+      && writer_pending(&conn->writer) < WRITER_LOW_WATER)
+    {
+      conn->read_paused = false;
+      if (!conn->recv_armed)
+        uring_recv(ctx, conn, fd);
+    }
+}
+
+static void
+uring_arm_accept(struct uring_ctx *ctx, struct thread_pipe *tp)
+{
+  struct io_uring_sqe *sqe = uring_sqe(&ctx->ring);
+  if (reuseport)
+    {
+      io_uring_prep_multishot_accept(sqe, tp->listen_fd, NULL, NULL, 0);
+      io_uring_sqe_set_data64(sqe,
+                              URING_DATA(URING_ACCEPT, tp->listen_fd, 0));
+    }
+  else
+    {
+      io_uring_prep_read(sqe, tp->pipefd[0], ctx->fdbuf, sizeof(ctx->fdbuf),
+                         0);
+      io_uring_sqe_set_data64(sqe,
+                              URING_DATA(URING_PIPE, tp->pipefd[0], 0));
+    }
+}
+
+void *
+uring_loop(void *context)
+{
+  struct thread_pipe *tp = (struct thread_pipe *)context;
+  struct uring_ctx ctx;
+  struct io_uring_params params;
+  struct io_uring_cqe *cqe;
+  struct conn_table table = { 0 };
+  struct conn *conn;
+  unsigned head, count;
+  uint64_t data;
+  int rc, fd;
+
+  memset(&params, 0x00, sizeof(params));
+  if (uring_sqpoll)
+    {
+      params.flags |= IORING_SETUP_SQPOLL;
+      params.sq_thread_idle = POLL_TIMEOUT;
+    }
+  rc = io_uring_queue_init_params(URING_ENTRIES, &ctx.ring, &params);
+  if (rc < 0)
+    {
+      syslog(LOG_ERR, "io_uring init failed in thread %d: %s", tp->thread_id,
+             strerror(-rc));
+      return NULL;
+    }
+  ctx.buf_ring = io_uring_setup_buf_ring(&ctx.ring, URING_BUF_COUNT,
+                                         URING_BUF_GROUP, 0, &rc);
+  if (!ctx.buf_ring)
+    {
+      syslog(LOG_ERR, "io_uring buffer ring failed in thread %d: %s",
+             tp->thread_id, strerror(-rc));
+      io_uring_queue_exit(&ctx.ring);
+      return NULL;
+    }
+  ctx.bufs = malloc((size_t)URING_BUF_COUNT * URING_BUF_SIZE);
+  if (!ctx.bufs)
+    {
+      syslog(LOG_ERR, "cannot allocate io_uring buffers in thread %d",
+             tp->thread_id);
+      io_uring_free_buf_ring(&ctx.ring, ctx.buf_ring, URING_BUF_COUNT,
+                             URING_BUF_GROUP);
+      io_uring_queue_exit(&ctx.ring);
+      return NULL;
+    }
+  for (int i = 0; i < URING_BUF_COUNT; i++)
+    io_uring_buf_ring_add(ctx.buf_ring, &ctx.bufs[(size_t)i * URING_BUF_SIZE],
+                          URING_BUF_SIZE, i,
+                          io_uring_buf_ring_mask(URING_BUF_COUNT), i);
+  io_uring_buf_ring_advance(ctx.buf_ring, URING_BUF_COUNT);
+  uring_arm_accept(&ctx, tp);
+
+  rcu_register_thread();
+  syslog(LOG_INFO, "init io_uring thread %d", tp->thread_id);
+
+  while (1)
+    {
+      // Same as ev_loop, quiescent between batches and offline while
+      // blocked.
+      rcu_quiescent_state();
+      if (io_uring_cq_ready(&ctx.ring))
+        rc = io_uring_submit(&ctx.ring);
+      else
         {
-        case 't':
-          num_threads = atoi(optarg);
-          // TODO only linux benefits from multithread. Print warning message
-          // for setting threads in other system.
-          break;
-        case 'p':
-          port_num = atoi(optarg);
-          break;
-        default:
-          printf("Usage: %s -t thread_num -p port\n", argv[0]);
-          exit(-1);
+          rcu_thread_offline();
+          rc = io_uring_submit_and_wait(&ctx.ring, 1);
+          rcu_thread_online();
         }
+      if (rc < 0 && rc != -EINTR)
+        syslog(LOG_ERR, "io_uring submit error: %s", strerror(-rc));
+
+      count = 0;
+      io_uring_for_each_cqe(&ctx.ring, head, cqe)
+      {
+        count++;
+        data = io_uring_cqe_get_data64(cqe);
+        fd = URING_DATA_FD(data);
+        switch (URING_DATA_OP(data))
+          {
+          case URING_ACCEPT:
+            if (cqe->res >= 0)
+              uring_open(&ctx, &table, cqe->res);
+            else
+              syslog(LOG_ERR, "Accept failed in thread %d: %s",
+                     tp->thread_id, strerror(-cqe->res));
+            if (!(cqe->flags & IORING_CQE_F_MORE))
+              uring_arm_accept(&ctx, tp);
+            break;
+          case URING_PIPE:
+            syslog(LOG_DEBUG, "accepting fd in thread %d", tp->thread_id);
+            for (int i = 0; i < cqe->res / (int)sizeof(int); i++)
+              uring_open(&ctx, &table, ctx.fdbuf[i]);
+            uring_arm_accept(&ctx, tp);
+            break;
+          case URING_RECV:
+            if (uring_stale(&ctx, &table, fd, data, cqe))
+              break;
+            conn = table.conns[fd];
+            uring_on_recv(&ctx, conn, fd, cqe, tp->thread_id);
+            break;
+          case URING_SEND:
+            if (uring_stale(&ctx, &table, fd, data, cqe))
+              break;
+            conn = table.conns[fd];
+            uring_on_send(&ctx, conn, fd, cqe, tp->thread_id);
+            break;
+          case URING_CANCEL:
+            // The cancelled recv reports its own completion. A cancel
+            // only matches the recv of its own generation, so one that
+            // outlived its connection finds nothing to cancel.
+            uring_stale(&ctx, &table, fd, data, cqe);
+            break;
+          }
+      }
+      io_uring_cq_advance(&ctx.ring, count);
     }
-  openlog("edamame", LOG_PERROR, LOG_USER);
-  // setlogmask(LOG_UPTO(LOG_ERR));
+  rcu_unregister_thread();
+  return NULL;
+}
+#endif
 
-  lru = lru_init(1 << 25, 20, 4096);
-  swiper = swiper_init(lru, 1 << 22);
+// Page size of the table and the page faults of the process so far
+static void
+log_table_pages(void)
+{
+  lru_table *table;
+  struct rusage usage;
 
-  pthread_t threads[num_threads];
-  struct thread_pipe tpipes[num_threads];
-  int fdbuf[num_threads][256];
-  int fdbuf_cnt[num_threads];
-  for (int i = 0; i < num_threads; i++)
+  table = atomic_load_explicit(&lru->table, memory_order_acquire);
+  getrusage(RUSAGE_SELF, &usage);
+  syslog(LOG_INFO,
+         "table of %zu bytes on %zu byte pages%s, %ld minor and %ld major "
+         "page faults",
+         table->map_size, table->page_size,
+         table->thp ? " with transparent huge pages" : "", usage.ru_minflt,
+         usage.ru_majflt);
+}
+
+// Hits by numa node of the worker, how local the lookups are
+static void
+log_node_hits(void)
+{
+  uint64_t hits;
+
+  for (int node = 0; node < LRU_NUMA_NODES; node++)
     {
-      tpipes[i].thread_id = i;
-      pipe(tpipes[i].pipefd);
-      pthread_create(&threads[i], NULL, ev_loop, &tpipes[i]);
+      hits = atomic_load_explicit(&lru->node_hits[node], memory_order_relaxed);
+      if (hits)
+        syslog(LOG_DEBUG, "%" PRIu64 " hits on node %d", hits, node);
     }
+}
+
+// Attributes of worker thread thread_id. With pin_threads its stack and
+// everything it allocates is faulted in on the node of its cpu.
+static void
+worker_attr(pthread_attr_t *attr, int thread_id)
+{
+  cpu_set_t allowed, cpuset;
+  int cpu, nth;
+
+  pthread_attr_init(attr);
+  if (!pin_threads || sched_getaffinity(0, sizeof(allowed), &allowed))
+    return;
+  nth = thread_id % CPU_COUNT(&allowed);
+  for (cpu = 0; cpu < CPU_SETSIZE; cpu++)
+    if (CPU_ISSET(cpu, &allowed) && !nth--)
+      break;
+  CPU_ZERO(&cpuset);
+  CPU_SET(cpu, &cpuset);
+  if (pthread_attr_setaffinity_np(attr, sizeof(cpuset), &cpuset))
+    syslog(LOG_ERR, "cannot pin thread %d to cpu %d", thread_id, cpu);
+}
+
+// Scan a part of the table a step at a time, like a single swiper does
+static void
+swipe_part(swiper_t *part)
+{
+  struct timespec ts = { 0, SWIPE_INTERVAL_MIN * 1000000 };
+
+  while (!lru_swipe_collect(part, 0, SWIPE_STEP_USEC))
+    {
+      rcu_thread_offline();
+      nanosleep(&ts, NULL);
+      rcu_thread_online();
+    }
+}
+
+static void
+swipe_barrier_wait(void)
+{
+  rcu_thread_offline();
+  pthread_barrier_wait(&swipe_barrier);
+  rcu_thread_online();
+}
+
+// Helper of the maintenance thread, scans its part of the table
+// whenever a parallel swipe starts.
+static void *
+swipe_part_loop(void *context)
+{
+  swiper_t *part = context;
+
+  rcu_register_thread();
+  while (1)
+    {
+      swipe_barrier_wait();
+      swipe_part(part);
+      swipe_barrier_wait();
+    }
+  rcu_unregister_thread();
+  return NULL;
+}
+
+// Every thread scans its part, then once the cutoff over all the parts
+// is known every thread evicts in its part.
+static void
+swipe_parallel(void)
+{
+  do
+    {
+      swipe_barrier_wait();
+      swipe_part(swipe_parts[0]);
+      swipe_barrier_wait();
+    }
+  while (!lru_swipe_merge(swipe_parts, swipe_threads));
+}
+
+// Maintenance thread that evicts expired and least recently updated
+// items. The pause between two swipes adapts to the pressure on the
+// table: it is cut short once the object count approaches the eviction
+// threshold or the last swipe found expired items, and backs off
+// towards SWIPE_INTERVAL_MAX while the table is idle. Instead of
+// evicting, the table is grown while it stays below max_objects, and
+// rebuilt at its size once deletes left too many tombstones. Memory
+// above the low water mark of mem_limit counts as pressure as well. A
+// swipe is done in short steps so that the workers are not starved of
+// memory bandwidth for the length of a whole pass.
+void *
+swiper_loop(void *context)
+{
+  swiper_t *swiper = (swiper_t *)context;
+  uint64_t objcnt, threshold;
+  bool mem_pressure;
+  long interval = SWIPE_INTERVAL_MAX, pause;
+  struct timespec ts;
+  cpu_set_t cpuset;
+
+  if (swiper_cpu >= 0)
+    {
+      CPU_ZERO(&cpuset);
+      CPU_SET(swiper_cpu, &cpuset);
+      if (pthread_setaffinity_np(pthread_self(), sizeof(cpuset), &cpuset))
+        syslog(LOG_ERR, "cannot pin swiper to cpu %d", swiper_cpu);
+    }
+  rcu_register_thread();
+  syslog(LOG_INFO, "init swiper thread");
+
+  while (1)
+    {
+      pause = swiper->resume ? SWIPE_INTERVAL_MIN : interval;
+      ts.tv_sec = pause / 1000;
+      ts.tv_nsec = pause % 1000 * 1000000;
+      rcu_thread_offline();
+      nanosleep(&ts, NULL);
+      rcu_thread_online();
+
+      // Move a resize along. Nothing is evicted until it is done.
+      if (!lru_migrate(swiper->lru, SWIPE_MIGRATE_STEP))
+        {
+          interval = SWIPE_INTERVAL_MIN;
+          continue;
+        }
+      lru_resize_end(swiper->lru);
+
+      threshold = LRU_SWIPE_THRESHOLD(lru_capacity(swiper->lru));
+      objcnt = atomic_load_explicit(&swiper->lru->objcnt,
+                                    memory_order_relaxed);
+      mem_pressure = swiper->lru->mem_limit
+                     && lru_mem_used(swiper->lru)
+                            > LRU_MEM_LOW_WATER(swiper->lru->mem_limit);
+      if (!swiper->resume)
+        {
+          if (objcnt >= threshold * 9 / 10 && threshold * 2 <= max_objects
+              && lru_resize(swiper->lru, threshold * 2))
+            {
+              syslog(LOG_INFO, "resizing for %" PRIu64 " objects",
+                     threshold * 2);
+              log_table_pages();
+              interval = SWIPE_INTERVAL_MIN;
+              continue;
+            }
+          if (lru_compact(swiper->lru))
+            {
+              syslog(LOG_INFO, "compacting %" PRIu64 " tombstones",
+                     (uint64_t)atomic_load_explicit(
+                         &swiper->lru->tombstones, memory_order_relaxed));
+              log_table_pages();
+              interval = SWIPE_INTERVAL_MIN;
+              continue;
+            }
+          // Well below the threshold and nothing expired last time, a
+          // swipe would only burn memory bandwidth.
+          if (objcnt < threshold * 9 / 10 && !mem_pressure
+              && !swiper->expired && interval < SWIPE_INTERVAL_MAX)
+            {
+              interval *= 2;
+              if (interval > SWIPE_INTERVAL_MAX)
+                interval = SWIPE_INTERVAL_MAX;
+              continue;
+            }
+        }
+
+      if (swipe_threads > 1)
+        swipe_parallel();
+      else if (!lru_swipe_step(swiper, 0, SWIPE_STEP_USEC))
+        continue;
+      syslog(LOG_DEBUG, "swiped %" PRIu64 " expired, %" PRIu64 " evicted",
+             swiper->expired, swiper->evicted);
+      log_node_hits();
+
+      objcnt = atomic_load_explicit(&swiper->lru->objcnt,
+                                    memory_order_relaxed);
+      if (swiper->evicted || swiper->expired || mem_pressure
+          || objcnt >= threshold * 9 / 10)
+        interval /= 2;
+      else
+        interval *= 2;
+      if (interval < SWIPE_INTERVAL_MIN)
+        interval = SWIPE_INTERVAL_MIN;
+      if (interval > SWIPE_INTERVAL_MAX)
+        interval = SWIPE_INTERVAL_MAX;
+    }
+  rcu_unregister_thread();
+  return NULL;
+}
+
+static int
+listen_socket(void)
+{
+  struct sockaddr_in addr;
+  const int on = 1;
+  int listen_fd, rc;
 
   addr = (struct sockaddr_in){
     .sin_family = AF_INET,
@@ -205,6 +999,13 @@ main(int argc, char **argv)
              strerror(errno));
       exit(-1);
     }
+  if (reuseport
+      && setsockopt(listen_fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)))
+    {
+      syslog(LOG_ERR, "Set socket opt SO_REUSEPORT failed: %s",
+             strerror(errno));
+      exit(-1);
+    }
   rc = fcntl(listen_fd, F_GETFL, 0);
   fcntl(listen_fd, F_SETFL, rc | O_NONBLOCK);
   rc = fcntl(listen_fd, F_GETFL, 0);
@@ -223,6 +1024,262 @@ main(int argc, char **argv)
       syslog(LOG_ERR, "listen failed: %s", strerror(errno));
       exit(-1);
     }
+  return listen_fd;
+}
+
+// Steer each connection to the listener (and thus the thread) with index
+// cpu % num_threads, where cpu is the cpu that handled the incoming SYN.
+// Sockets in a SO_REUSEPORT group are indexed by the order they were
+// bound, so the listeners must be created in thread order.
+static void
+attach_cpu_steering(int listen_fd, int num_threads)
+{
+  struct sock_filter code[] = {
+    { BPF_LD | BPF_W | BPF_ABS, 0, 0, SKF_AD_OFF + SKF_AD_CPU },
+    { BPF_ALU | BPF_MOD | BPF_K, 0, 0, num_threads },
+    { BPF_RET | BPF_A, 0, 0, 0 },
+  };
+  struct sock_fprog prog = {
+    .len = sizeof(code) / sizeof(code[0]),
+    .filter = code,
+  };
+  if (setsockopt(listen_fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog,
+                 sizeof(prog)))
+    syslog(LOG_ERR, "Attach reuseport cbpf failed: %s", strerror(errno));
+}
+
+int
+main(int argc, char **argv)
+{
+  int c, num_threads = 1;
+  int listen_fd, rc, round_robin = 0;
+  bool cpu_steering = false;
+  struct pollfd listen_poll[1];
+  char *end;
+
+  void *(*thread_loop)(void *) = ev_loop;
+
+  while ((c = getopt(argc, argv, "t:p:rcuqa:n:N:m:w:e:k:Ti:v:Hf:IP")) != -1)
+    {
+      switch (c)
+        {
+        case 't':
+          num_threads = atoi(optarg);
+          // TODO only linux benefits from multithread. Print warning message
+          // for setting threads in other system.
+          break;
+        case 'p':
+          port_num = atoi(optarg);
+          break;
+        case 'r':
+          reuseport = true;
+          break;
+        case 'c':
+          cpu_steering = true;
+          break;
+        case 'a':
+          swiper_cpu = atoi(optarg);
+          break;
+        case 'n':
+          num_objects = strtoull(optarg, NULL, 10);
+          break;
+        case 'N':
+          max_objects = strtoull(optarg, NULL, 10);
+          break;
+        case 'e':
+          if (!strcmp(optarg, "sample"))
+            swipe_policy = SWIPE_SAMPLE;
+          else if (strcmp(optarg, "scan"))
+            {
+              printf("unknown eviction policy %s\n", optarg);
+              exit(-1);
+            }
+          break;
+        case 'k':
+          swipe_threads = atoi(optarg);
+          if (swipe_threads < 1)
+            swipe_threads = 1;
+          break;
+        case 'w':
+          touch_window = strtoull(optarg, NULL, 10);
+          break;
+        case 'T':
+          clock_cached = false;
+          break;
+        case 'i':
+          inline_keylen = strtoull(optarg, &end, 10);
+          if (!isdigit((unsigned char)*optarg) || *end || !inline_keylen)
+            {
+              printf("invalid inline key size %s\n", optarg);
+              exit(-1);
+            }
+          break;
+        case 'v':
+          inline_vallen = strtoull(optarg, &end, 10);
+          if (!isdigit((unsigned char)*optarg) || *end || !inline_vallen)
+            {
+              printf("invalid inline value size %s\n", optarg);
+              exit(-1);
+            }
+          break;
+        case 'H':
+          lru_hugetlb = true;
+          break;
+        case 'f':
+          prefault_threads = atoi(optarg);
+          break;
+        case 'I':
+          lru_interleave = true;
+          break;
+        case 'P':
+          pin_threads = true;
+          break;
+        case 'm':
+          mem_limit = strtoull(optarg, &end, 10);
+          switch (*end)
+            {
+            case 'g':
+            case 'G':
+              mem_limit <<= 10;
+              /* fall through */
+            case 'm':
+            case 'M':
+              mem_limit <<= 10;
+              /* fall through */
+            case 'k':
+            case 'K':
+              mem_limit <<= 10;
+              end++;
+              break;
+            }
+          if (!isdigit((unsigned char)*optarg) || *end)
+            {
+              printf("invalid memory limit %s\n", optarg);
+              exit(-1);
+            }
+          break;
+#ifdef HAVE_LIBURING_H
+        case 'u':
+          thread_loop = uring_loop;
+          break;
+        case 'q':
+          uring_sqpoll = true;
+          break;
+#else
+        case 'u':
+        case 'q':
+          printf("%s is built without io_uring support\n", argv[0]);
+          exit(-1);
+#endif
+        default:
+          printf("Usage: %s -t thread_num -p port [-r [-c]] [-u [-q]] "
+                 "[-a cpu] [-n objects [-N objects]] [-m bytes] "
+                 "[-w txids] [-e scan|sample] [-k threads] [-T] "
+                 "[-i bytes] [-v bytes] [-H] [-f threads] [-I] [-P]\n"
+                 "  -r  one SO_REUSEPORT listener per thread\n"
+                 "  -c  steer connections to threads by incoming cpu\n"
+                 "  -u  use the io_uring network backend\n"
+                 "  -q  let a kernel thread poll the io_uring submissions\n"
+                 "  -a  pin the eviction thread to this cpu\n"
+                 "  -n  initial number of objects\n"
+                 "  -N  grow the table up to this number of objects\n"
+                 "  -m  evict above this many bytes, k, m or g suffixed\n"
+                 "  -w  hits refresh items older than this many writes\n"
+                 "  -e  scan the whole table or sample it to evict\n"
+                 "  -k  split a scan over this many threads\n"
+                 "  -T  read the clock on every write, not a cached one\n"
+                 "  -i  keys up to this size are stored in the bucket\n"
+                 "  -v  values up to this size are stored in the bucket\n"
+                 "  -H  map the table with explicit huge pages\n"
+                 "  -f  fault the table in with this many threads first\n"
+                 "  -I  interleave the table over the numa nodes\n"
+                 "  -P  pin worker thread i to the i-th allowed cpu\n",
+                 argv[0]);
+          exit(-1);
+        }
+    }
+  if (swipe_threads > 1 && swipe_policy != SWIPE_SCAN)
+    {
+      printf("-k only applies to -e scan\n");
+      exit(-1);
+    }
+  // Steering attaches to the reuseport group, there is none without -r
+  if (cpu_steering && !reuseport)
+    {
+      printf("-c only applies to -r\n");
+      exit(-1);
+    }
+  openlog("edamame", LOG_PERROR, LOG_USER);
+  // setlogmask(LOG_UPTO(LOG_ERR));
+  if (clock_cached)
+    clock_start();
+
+  lru = lru_init(num_objects, inline_keylen, inline_vallen);
+  if (!lru)
+    exit(-1);
+  if (prefault_threads > 0)
+    lru_prefault(lru, prefault_threads);
+  log_table_pages();
+  lru->mem_limit = mem_limit;
+  lru->touch_window = touch_window;
+  if (mem_limit && lru_mem_used(lru) > LRU_MEM_LOW_WATER(mem_limit))
+    syslog(LOG_WARNING, "the table alone takes %" PRIu64 " of %" PRIu64
+           " bytes", lru_mem_used(lru), mem_limit);
+  swipe_parts = calloc(swipe_threads, sizeof(swiper_t *));
+  for (int i = 0; i < swipe_threads; i++)
+    {
+      swipe_parts[i] = swiper_init(lru);
+      swipe_parts[i]->policy = swipe_policy;
+      swipe_parts[i]->part = i;
+      swipe_parts[i]->nparts = swipe_threads;
+    }
+  swiper = swipe_parts[0];
+  pthread_barrier_init(&swipe_barrier, NULL, swipe_threads);
+
+  pthread_t swiper_thread;
+  pthread_create(&swiper_thread, NULL, swiper_loop, swiper);
+  pthread_t swipe_part_threads[swipe_threads];
+  for (int i = 1; i < swipe_threads; i++)
+    pthread_create(&swipe_part_threads[i], NULL, swipe_part_loop,
+                   swipe_parts[i]);
+
+  pthread_t threads[num_threads];
+  pthread_attr_t attr;
+  struct thread_pipe tpipes[num_threads];
+  int fdbuf[num_threads][256];
+  int fdbuf_cnt[num_threads];
+
+  if (reuseport)
+    {
+      for (int i = 0; i < num_threads; i++)
+        {
+          tpipes[i].thread_id = i;
+          tpipes[i].listen_fd = listen_socket();
+        }
+      if (cpu_steering)
+        attach_cpu_steering(tpipes[0].listen_fd, num_threads);
+      for (int i = 0; i < num_threads; i++)
+        {
+          worker_attr(&attr, i);
+          pthread_create(&threads[i], &attr, thread_loop, &tpipes[i]);
+          pthread_attr_destroy(&attr);
+        }
+      for (int i = 0; i < num_threads; i++)
+        pthread_join(threads[i], NULL);
+      return 0;
+    }
+
+  for (int i = 0; i < num_threads; i++)
+    {
+      tpipes[i].thread_id = i;
+      tpipes[i].listen_fd = -1;
+      pipe(tpipes[i].pipefd);
+      worker_attr(&attr, i);
+      pthread_create(&threads[i], &attr, thread_loop, &tpipes[i]);
+      pthread_attr_destroy(&attr);
+    }
+
+  listen_fd = listen_socket();
   listen_poll[0].fd = listen_fd;
   listen_poll[0].events = POLLIN;
 
@@ -242,7 +1299,8 @@ main(int argc, char **argv)
         fdbuf_cnt[i] = 0;
       while (1)
         {
-          int clientfd = accept(listen_poll[0].fd, NULL, NULL);
+          int clientfd
+              = accept4(listen_poll[0].fd, NULL, NULL, SOCK_NONBLOCK);
           if (clientfd < 0)
             {
               if (errno != EWOULDBLOCK)
@@ -261,7 +1319,13 @@ main(int argc, char **argv)
               break;
             }
           fdbuf[round_robin][fdbuf_cnt[round_robin]] = clientfd;
-          fdbuf_cnt[round_robin]++;
+          // fdbuf is full, forward it before accepting more
+          if (++fdbuf_cnt[round_robin] == 256)
+            {
+              write(tpipes[round_robin].pipefd[1], &fdbuf[round_robin][0],
+                    sizeof(int) * 256);
+              fdbuf_cnt[round_robin] = 0;
+            }
           if (++round_robin >= num_threads)
             round_robin = 0;
         }
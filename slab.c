@@ -0,0 +1,287 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <syslog.h>
+
+#include "slab.h"
+
+struct slab_magazine
+{
+  uint32_t cnt;
+  void *chunks[SLAB_MAGAZINE_SIZE];
+};
+
+struct slab_class
+{
+  pthread_mutex_t lock;
+  size_t size;
+  // free chunks, linked through their first word
+  void *free_list;
+  // page being carved, and chunks left in it
+  uint8_t *page;
+  size_t page_left;
+
+  atomic_ullong pages;
+  atomic_ullong chunks;
+  atomic_ullong used;
+  atomic_ullong requested;
+};
+
+static struct slab_class slab_class[SLAB_CLASSES + 1];
+static int slab_nclasses;
+static pthread_once_t slab_once = PTHREAD_ONCE_INIT;
+// Returns the magazines of an exiting thread to the free lists
+static pthread_key_t slab_key;
+static __thread struct slab_magazine *slab_magazines;
+
+static void slab_thread_exit(void *magazines);
+
+static void
+slab_init(void)
+{
+  size_t size;
+
+  for (size = SLAB_MIN_CHUNK;
+       size <= SLAB_MAX_CHUNK && slab_nclasses < SLAB_CLASSES;
+       size = (size * 5 / 4 + 7) & ~7UL)
+    {
+      pthread_mutex_init(&slab_class[slab_nclasses].lock, NULL);
+      slab_class[slab_nclasses++].size = size;
+    }
+  pthread_key_create(&slab_key, slab_thread_exit);
+}
+
+// Smallest class whose chunks hold size bytes, slab_nclasses if none.
+static int
+slab_class_of(size_t size)
+{
+  int lo = 0, hi = slab_nclasses;
+
+  while (lo < hi)
+    {
+      int mid = (lo + hi) / 2;
+      if (slab_class[mid].size < size)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+  return lo;
+}
+
+static struct slab_magazine *
+slab_thread_magazines(void)
+{
+  if (!slab_magazines)
+    {
+      pthread_once(&slab_once, slab_init);
+      // Without magazines the thread works on the free lists directly,
+      // and tries again on its next call.
+      slab_magazines = calloc(SLAB_CLASSES, sizeof(struct slab_magazine));
+      if (slab_magazines)
+        pthread_setspecific(slab_key, slab_magazines);
+    }
+  return slab_magazines;
+}
+
+// Take a chunk from the free list or carve a fresh one, NULL if no page
+// can be mapped. Called with the class lock held.
+static void *
+slab_chunk(struct slab_class *class)
+{
+  void *chunk;
+  uint8_t *page;
+
+  if (class->free_list)
+    {
+      chunk = class->free_list;
+      class->free_list = *(void **)chunk;
+      return chunk;
+    }
+  if (!class->page_left)
+    {
+      page = mmap(NULL, SLAB_PAGE_SIZE, PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (page == MAP_FAILED)
+        {
+          syslog(LOG_ERR, "cannot map a slab page for %zu bytes",
+                 class->size);
+          return NULL;
+        }
+      class->page = page;
+      class->page_left = SLAB_PAGE_SIZE / class->size;
+      atomic_fetch_add_explicit(&class->pages, 1, memory_order_relaxed);
+      atomic_fetch_add_explicit(&class->chunks, class->page_left,
+                                memory_order_relaxed);
+    }
+  chunk = class->page;
+  class->page += class->size;
+  class->page_left--;
+  return chunk;
+}
+
+// Fill half of an empty magazine from the free list or fresh chunks.
+static bool
+slab_refill(struct slab_class *class, struct slab_magazine *magazine)
+{
+  void *chunk;
+
+  pthread_mutex_lock(&class->lock);
+  while (magazine->cnt < SLAB_MAGAZINE_SIZE / 2
+         && (chunk = slab_chunk(class)))
+    magazine->chunks[magazine->cnt++] = chunk;
+  pthread_mutex_unlock(&class->lock);
+  return magazine->cnt > 0;
+}
+
+// Move the n oldest chunks of a magazine back to the free list.
+static void
+slab_flush(struct slab_class *class, struct slab_magazine *magazine,
+           uint32_t n)
+{
+  pthread_mutex_lock(&class->lock);
+  for (uint32_t i = 0; i < n; i++)
+    {
+      *(void **)magazine->chunks[i] = class->free_list;
+      class->free_list = magazine->chunks[i];
+    }
+  pthread_mutex_unlock(&class->lock);
+  magazine->cnt -= n;
+  for (uint32_t i = 0; i < magazine->cnt; i++)
+    magazine->chunks[i] = magazine->chunks[i + n];
+}
+
+static void
+slab_thread_exit(void *magazines)
+{
+  struct slab_magazine *magazine = magazines;
+
+  for (int cls = 0; cls < slab_nclasses; cls++)
+    slab_flush(&slab_class[cls], &magazine[cls], magazine[cls].cnt);
+  free(magazines);
+}
+
+void *
+slab_alloc(size_t size)
+{
+  struct slab_magazine *magazine;
+  struct slab_class *class;
+  void *ptr;
+  int cls;
+
+  magazine = slab_thread_magazines();
+  cls = slab_class_of(size);
+  class = &slab_class[cls];
+  atomic_fetch_add_explicit(&class->used, 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&class->requested, size, memory_order_relaxed);
+  if (cls == slab_nclasses)
+    ptr = malloc(size);
+  else if (!magazine)
+    {
+      pthread_mutex_lock(&class->lock);
+      ptr = slab_chunk(class);
+      pthread_mutex_unlock(&class->lock);
+    }
+  else
+    {
+      magazine = &magazine[cls];
+      if (magazine->cnt || slab_refill(class, magazine))
+        ptr = magazine->chunks[--magazine->cnt];
+      else
+        ptr = NULL;
+    }
+  if (!ptr)
+    {
+      atomic_fetch_sub_explicit(&class->used, 1, memory_order_relaxed);
+      atomic_fetch_sub_explicit(&class->requested, size,
+                                memory_order_relaxed);
+    }
+  return ptr;
+}
+
+void
+slab_free(void *ptr, size_t size)
+{
+  struct slab_magazine *magazine;
+  struct slab_class *class;
+  int cls;
+
+  if (!ptr)
+    return;
+  magazine = slab_thread_magazines();
+  cls = slab_class_of(size);
+  class = &slab_class[cls];
+  atomic_fetch_sub_explicit(&class->used, 1, memory_order_relaxed);
+  atomic_fetch_sub_explicit(&class->requested, size, memory_order_relaxed);
+  if (cls == slab_nclasses)
+    {
+      free(ptr);
+      return;
+    }
+  if (!magazine)
+    {
+      pthread_mutex_lock(&class->lock);
+      *(void **)ptr = class->free_list;
+      class->free_list = ptr;
+      pthread_mutex_unlock(&class->lock);
+      return;
+    }
+
+  magazine = &magazine[cls];
+  if (magazine->cnt == SLAB_MAGAZINE_SIZE)
+    slab_flush(class, magazine, SLAB_MAGAZINE_SIZE / 2);
+  magazine->chunks[magazine->cnt++] = ptr;
+}
+
+size_t
+slab_chunk_size(size_t size)
+{
+  int cls;
+
+  pthread_once(&slab_once, slab_init);
+  cls = slab_class_of(size);
+  return cls == slab_nclasses ? size : slab_class[cls].size;
+}
+
+int
+slab_classes(void)
+{
+  pthread_once(&slab_once, slab_init);
+  return slab_nclasses;
+}
+
+bool
+slab_class_stats(int cls, struct slab_stats *stats)
+{
+  struct slab_class *class;
+
+  if (cls < 0 || cls > slab_classes())
+    return false;
+  class = &slab_class[cls];
+  stats->chunk_size = class->size;
+  stats->pages = atomic_load_explicit(&class->pages, memory_order_relaxed);
+  stats->chunks = atomic_load_explicit(&class->chunks, memory_order_relaxed);
+  stats->used = atomic_load_explicit(&class->used, memory_order_relaxed);
+  stats->requested
+      = atomic_load_explicit(&class->requested, memory_order_relaxed);
+  return true;
+}
@@ -0,0 +1,62 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+#ifndef EDAMAME_SLAB_H_
+#define EDAMAME_SLAB_H_ 1
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Out of line keys and values are carved from SLAB_PAGE_SIZE pages split
+// into chunks of one size class. Classes grow by 1.25 from
+// SLAB_MIN_CHUNK, anything above SLAB_MAX_CHUNK is left to malloc. Pages
+// are never unmapped: freed chunks go back to the free list of their
+// class and are only reused by allocations of that class.
+#define SLAB_PAGE_SIZE (1024 * 1024)
+#define SLAB_MIN_CHUNK 16
+#define SLAB_MAX_CHUNK (SLAB_PAGE_SIZE / 8)
+#define SLAB_CLASSES 48
+// Free chunks each thread keeps per class before going to the shared
+// free list.
+#define SLAB_MAGAZINE_SIZE 32
+
+struct slab_stats
+{
+  // 0 for the allocations left to malloc
+  size_t chunk_size;
+  uint64_t pages;
+  // chunks carved from the pages so far, and chunks in use
+  uint64_t chunks;
+  uint64_t used;
+  // bytes asked for by the chunks in use
+  uint64_t requested;
+};
+
+// The size has to be passed back to slab_free.
+void *slab_alloc(size_t size);
+void slab_free(void *ptr, size_t size);
+// Bytes a slab_alloc of size takes, the size of its chunk.
+size_t slab_chunk_size(size_t size);
+// Classes are numbered from 0 to slab_classes(), the last one accounts
+// for the allocations above SLAB_MAX_CHUNK.
+int slab_classes(void);
+bool slab_class_stats(int cls, struct slab_stats *stats);
+
+#endif
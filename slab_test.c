@@ -0,0 +1,153 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+#include <pthread.h>
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <cmocka.h>
+
+#include "slab.h"
+
+static void
+test_classes(void **context)
+{
+  struct slab_stats stats, prev;
+  int nclasses;
+
+  nclasses = slab_classes();
+  assert_true(nclasses > 1);
+  assert_true(nclasses <= SLAB_CLASSES);
+  assert_true(slab_class_stats(0, &prev));
+  assert_int_equal(SLAB_MIN_CHUNK, prev.chunk_size);
+  for (int cls = 1; cls < nclasses; cls++)
+    {
+      assert_true(slab_class_stats(cls, &stats));
+      assert_true(stats.chunk_size > prev.chunk_size);
+      assert_true(stats.chunk_size <= SLAB_MAX_CHUNK);
+      assert_int_equal(0, stats.chunk_size % 8);
+      prev = stats;
+    }
+  assert_true(slab_class_stats(nclasses, &stats));
+  assert_int_equal(0, stats.chunk_size);
+  assert_false(slab_class_stats(nclasses + 1, &stats));
+}
+
+static void
+test_alloc_free(void **context)
+{
+  struct slab_stats stats;
+  void *ptrs[1000];
+
+  for (int i = 0; i < 1000; i++)
+    {
+      ptrs[i] = slab_alloc(17);
+      assert_non_null(ptrs[i]);
+      memset(ptrs[i], i, 17);
+    }
+  // 17 bytes do not fit the smallest class
+  assert_true(slab_class_stats(1, &stats));
+  assert_int_equal(1000, stats.used);
+  assert_int_equal(17000, stats.requested);
+  assert_int_equal(1, stats.pages);
+  assert_int_equal(SLAB_PAGE_SIZE / stats.chunk_size, stats.chunks);
+  for (int i = 0; i < 1000; i++)
+    {
+      for (int j = 0; j < 17; j++)
+        assert_int_equal((uint8_t)i, ((uint8_t *)ptrs[i])[j]);
+      slab_free(ptrs[i], 17);
+    }
+  assert_true(slab_class_stats(1, &stats));
+  assert_int_equal(0, stats.used);
+  assert_int_equal(0, stats.requested);
+
+  // Freed chunks are reused before a new page is carved
+  for (int i = 0; i < 1000; i++)
+    ptrs[i] = slab_alloc(24);
+  assert_true(slab_class_stats(1, &stats));
+  assert_int_equal(1, stats.pages);
+  for (int i = 0; i < 1000; i++)
+    slab_free(ptrs[i], 24);
+}
+
+static void
+test_large(void **context)
+{
+  struct slab_stats stats;
+  void *ptr;
+
+  ptr = slab_alloc(SLAB_MAX_CHUNK + 1);
+  assert_non_null(ptr);
+  memset(ptr, 1, SLAB_MAX_CHUNK + 1);
+  assert_true(slab_class_stats(slab_classes(), &stats));
+  assert_int_equal(1, stats.used);
+  assert_int_equal(SLAB_MAX_CHUNK + 1, stats.requested);
+  assert_int_equal(0, stats.pages);
+  slab_free(ptr, SLAB_MAX_CHUNK + 1);
+  assert_true(slab_class_stats(slab_classes(), &stats));
+  assert_int_equal(0, stats.used);
+}
+
+static void *
+alloc_thread(void *arg)
+{
+  void **ptrs = arg;
+
+  for (int i = 0; i < 100; i++)
+    ptrs[i] = slab_alloc(100);
+  return NULL;
+}
+
+static void
+test_cross_thread(void **context)
+{
+  struct slab_stats stats;
+  pthread_t thread;
+  void *ptrs[100];
+  int cls;
+
+  // Chunks allocated by one thread are freed by another, the magazines
+  // of the exiting thread go back to the free list.
+  pthread_create(&thread, NULL, alloc_thread, ptrs);
+  pthread_join(thread, NULL);
+  for (int i = 0; i < 100; i++)
+    slab_free(ptrs[i], 100);
+  for (cls = 0; cls < slab_classes(); cls++)
+    {
+      assert_true(slab_class_stats(cls, &stats));
+      if (stats.chunk_size >= 100)
+        break;
+    }
+  assert_int_equal(0, stats.used);
+  assert_int_equal(1, stats.pages);
+}
+
+int
+main(void)
+{
+  const struct CMUnitTest slab_tests[] = {
+    cmocka_unit_test(test_classes),
+    cmocka_unit_test(test_alloc_free),
+    cmocka_unit_test(test_large),
+    cmocka_unit_test(test_cross_thread),
+  };
+  return cmocka_run_group_tests(slab_tests, NULL, NULL);
+}
@@ -22,6 +22,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/socket.h>
 #include <syslog.h>
 #include <unistd.h>
 
@@ -45,6 +46,13 @@ buffer_init(ed_buffer *buffer, size_t size)
   buffer->next = NULL;
 }
 
+void
+buffer_free(ed_buffer *buffer)
+{
+  free(buffer->buffer);
+  free(buffer);
+}
+
 void
 writer_init(ed_writer *writer, size_t size)
 {
@@ -60,12 +68,28 @@ writer_init(ed_writer *writer, size_t size)
     {
       ed_buffer *tmp = iter;
       iter = iter->next;
-      free(tmp);
+      buffer_free(tmp);
     }
+  writer->head = writer->end;
   writer->head->sent_idx = 0;
   writer->head->filled_idx = 0;
 }
 
+// Release every buffer, the next writer_init allocates a new one.
+void
+writer_free(ed_writer *writer)
+{
+  ed_buffer *tmp;
+
+  while (writer->head)
+    {
+      tmp = writer->head;
+      writer->head = tmp->next;
+      buffer_free(tmp);
+    }
+  writer->end = NULL;
+}
+
 bool
 writer_reserve(ed_writer *writer, size_t nbyte)
 {
@@ -111,35 +135,100 @@ writer_snprintf(ed_writer *writer, size_t nbyte, const char *format, ...)
   return true;
 }
 
-bool
-writer_flush(ed_writer *writer, int fd)
+// Fill iov with the pending (filled but not sent) segments of the buffer
+// chain, at most iovcnt of them. Returns the number of segments filled.
+// The segments stay valid until they are released by writer_consume.
+int
+writer_iovec(ed_writer *writer, struct iovec *iov, int iovcnt)
 {
-  ed_buffer **iter = &writer->head;
-  ssize_t written;
+  int cnt = 0;
+  for (ed_buffer *iter = writer->head; iter && cnt < iovcnt;
+       iter = iter->next)
+    {
+      if (iter->sent_idx == iter->filled_idx)
+        continue;
+      iov[cnt].iov_base = &iter->buffer[iter->sent_idx];
+      iov[cnt].iov_len = iter->filled_idx - iter->sent_idx;
+      cnt++;
+    }
+  return cnt;
+}
+
+// Mark nbyte as sent, releasing every buffer that was fully sent except
+// the last one, which is rewound for reuse.
+void
+writer_consume(ed_writer *writer, size_t nbyte)
+{
+  ed_buffer *head;
+  size_t pending;
   while (true)
     {
-      if ((*iter)->sent_idx == (*iter)->filled_idx)
+      head = writer->head;
+      pending = head->filled_idx - head->sent_idx;
+      if (nbyte < pending)
+        {
+          head->sent_idx += nbyte;
+          return;
+        }
+      nbyte -= pending;
+      if (head == writer->end)
         {
-          if (*iter == writer->end)
-            {
-              (*iter)->sent_idx = 0;
-              (*iter)->filled_idx = 0;
-              return true;
-            }
-          ed_buffer *tmp = *iter;
-          *iter = (*iter)->next;
-          free(tmp);
-          continue;
+          head->sent_idx = 0;
+          head->filled_idx = 0;
+          return;
         }
-      written = write(fd, &(*iter)->buffer[(*iter)->sent_idx],
-                      (*iter)->filled_idx - (*iter)->sent_idx);
+      writer->head = head->next;
+      buffer_free(head);
+    }
+}
+
+size_t
+writer_pending(ed_writer *writer)
+{
+  size_t pending = 0;
+  for (ed_buffer *iter = writer->head; iter; iter = iter->next)
+    pending += iter->filled_idx - iter->sent_idx;
+  return pending;
+}
+
+// Position in the last buffer, to drop what was appended after it with
+// writer_rewind. Only valid until the next writer_reserve or flush.
+size_t
+writer_mark(ed_writer *writer)
+{
+  return writer->end->filled_idx;
+}
+
+void
+writer_rewind(ed_writer *writer, size_t mark)
+{
+  writer->end->filled_idx = mark;
+}
+
+// Send every pending buffer with a single sendmsg call. A partial send
+// leaves the remainder in place, writer_consume tracks progress across
+// buffer boundaries. Returns false on a socket error. When the socket
+// would block, the rest stays pending and the caller is expected to
+// retry once the fd becomes writable.
+bool
+writer_flush(ed_writer *writer, int fd)
+{
+  struct iovec iov[WRITER_IOV_MAX];
+  struct msghdr msg;
+  ssize_t written;
+
+  memset(&msg, 0x00, sizeof(msg));
+  msg.msg_iov = iov;
+  while ((msg.msg_iovlen = writer_iovec(writer, iov, WRITER_IOV_MAX)))
+    {
+      written = sendmsg(fd, &msg, MSG_NOSIGNAL);
       if (written < 0)
         {
-          if (errno != EWOULDBLOCK)
-            return false;
-          // TODO need to register poll
-          return true;
+          if (errno == EINTR)
+            continue;
+          return errno == EAGAIN || errno == EWOULDBLOCK;
         }
-      (*iter)->sent_idx += written;
+      writer_consume(writer, written);
     }
+  return true;
 }
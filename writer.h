@@ -23,17 +23,28 @@
 #include <stdbool.h>
 #include <stddef.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 
 #define WRITER_DEFAULT_SIZE 65536
+#define WRITER_IOV_MAX 64
+// Pending output thresholds used by the event loops for backpressure.
+#define WRITER_HIGH_WATER (4 * 1024 * 1024)
+#define WRITER_LOW_WATER (1024 * 1024)
 
 typedef struct ed_writer ed_writer;
 typedef struct ed_buffer ed_buffer;
 
 void writer_init(ed_writer *writer, size_t size);
+void writer_free(ed_writer *writer);
 bool writer_reserve(ed_writer *writer, size_t nbyte);
 bool writer_append(ed_writer *writer, const void *buf, size_t nbyte);
 bool writer_snprintf(ed_writer *writer, size_t nbyte, const char *format, ...);
 bool writer_flush(ed_writer *writer, int fd);
+int writer_iovec(ed_writer *writer, struct iovec *iov, int iovcnt);
+void writer_consume(ed_writer *writer, size_t nbyte);
+size_t writer_pending(ed_writer *writer);
+size_t writer_mark(ed_writer *writer);
+void writer_rewind(ed_writer *writer, size_t mark);
 
 struct ed_writer
 {